@@ -1,31 +1,18 @@
 #include "ac.h"
 #include "config.h"
 #include "ir.h"
+#include "ir_decoder.h"
 #include "protocol_parsers.h"
 #include <esp_log.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 
 static const char *TAG = "AC";
 
-typedef struct {
-    const char *name;
-    int (*ir_recv)(rmt_symbol_word_t *symbols, size_t len);
-    int (*ir_send)(void);
-    int min_temperature;
-    int max_temperature;
-    ac_fan_t *supported_fans;
-    ac_mode_t *supported_modes;
-} ac_ops_t;
-
-static ac_ops_t *ac_ops = NULL;
-static ac_on_power_changed_t on_power_changed_cb = NULL;
-static ac_on_temperature_changed_t on_temperature_changed_cb = NULL;
-static ac_on_mode_changed_t on_mode_changed_cb = NULL;
-static ac_on_fan_changed_t on_fan_changed_cb = NULL;
-
-static union {
+typedef union {
     uint64_t data;
     struct {
         uint64_t detected_power:1;
@@ -35,7 +22,46 @@ static union {
         uint64_t mode:4;
         uint64_t :47;
     };
-} current_state = {};
+} ac_state_t;
+
+/* Requested change to the AC state, -1 for fields that should be unchanged */
+typedef struct {
+    int power;
+    int temperature;
+    int mode;
+    int fan;
+} ac_update_t;
+
+typedef struct {
+    const char *name;
+    ir_protocol_t *protocol;
+    /* Cheap structural checks, before a frame is decoded */
+    ac_reject_t (*validate)(uint64_t frame);
+    int (*decode)(uint64_t frame, const ac_state_t *state,
+        ac_update_t *update);
+    uint64_t (*encode)(const ac_state_t *state);
+    int min_temperature;
+    int max_temperature;
+    ac_fan_t *supported_fans;
+    ac_mode_t *supported_modes;
+} ac_ops_t;
+
+static ac_ops_t *ac_ops = NULL;
+static ac_on_state_changed_t on_state_changed_cb = NULL;
+
+static ac_state_t current_state = {};
+static unsigned int transaction_depth = 0;
+static uint8_t is_state_dirty = 0;
+static uint32_t pending_changes = 0;
+
+/* Some remotes send the same burst more than once, in separate captures.
+ * The window starts at the burst's first capture, so pressing the same
+ * button again right after isn't mistaken for a repeat */
+#define AC_DUPLICATE_WINDOW_US (300 * 1000)
+static uint32_t rejected_frames[AC_REJECT_MAX] = {};
+static ir_protocol_t *last_protocol = NULL;
+static uint64_t last_frame = 0;
+static int64_t last_frame_time = 0;
 
 typedef struct {
     int value;
@@ -62,38 +88,64 @@ static int mode_to_value(value_mode_t *value_modes, int mode)
     return -1;
 }
 
-static void update_state(int power, int temperature, ac_mode_t mode,
-    ac_fan_t fan)
+static void commit_state(void)
 {
-    if (power != -1 && current_state.power != power)
+    uint32_t changed = pending_changes;
+
+    if (!is_state_dirty)
+        return;
+
+    is_state_dirty = 0;
+    pending_changes = 0;
+
+    config_ac_persistent_save(current_state.data);
+    ESP_LOGI(TAG, "Power: %d, temp: %dC, mode: %d, fan: %d",
+        current_state.power, current_state.temperature, current_state.mode,
+        current_state.fan);
+
+    if (changed && on_state_changed_cb)
+        on_state_changed_cb(changed);
+}
+
+/* Merges an update into a state, returns a bitmask of ac_changed_t */
+static uint32_t merge_state(ac_state_t *state, int power, int temperature,
+    int mode, int fan)
+{
+    uint32_t changed = 0;
+
+    if (power != -1 && state->power != power)
     {
-        current_state.power = power;
-        if (on_power_changed_cb)
-            on_power_changed_cb(power);
+        state->power = power;
+        changed |= AC_CHANGED_POWER;
     }
-    if (temperature != -1 && current_state.temperature != temperature)
+    if (temperature != -1 && state->temperature != temperature)
     {
-        current_state.temperature = temperature;
-        if (on_temperature_changed_cb)
-            on_temperature_changed_cb(temperature);
+        state->temperature = temperature;
+        changed |= AC_CHANGED_TEMPERATURE;
     }
-    if (mode != -1 && current_state.mode != mode)
+    if (mode != -1 && state->mode != mode)
     {
-        current_state.mode = mode;
-        if (on_mode_changed_cb)
-            on_mode_changed_cb(mode);
+        state->mode = mode;
+        changed |= AC_CHANGED_MODE;
     }
-    if (fan != -1 && current_state.fan != fan)
+    if (fan != -1 && state->fan != fan)
     {
-        current_state.fan = fan;
-        if (on_fan_changed_cb)
-            on_fan_changed_cb(fan);
+        state->fan = fan;
+        changed |= AC_CHANGED_FAN;
     }
 
-    config_ac_persistent_save(current_state.data);
-    ESP_LOGI(TAG, "Power: %d, temp: %dC, mode: %d, fan: %d",
-        current_state.power, current_state.temperature, current_state.mode,
-        current_state.fan);
+    return changed;
+}
+
+static void update_state(int power, int temperature, ac_mode_t mode,
+    ac_fan_t fan)
+{
+    pending_changes |= merge_state(&current_state, power, temperature, mode,
+        fan);
+
+    is_state_dirty = 1;
+    if (!transaction_depth)
+        commit_state();
 }
 
 /* Airwell */
@@ -115,6 +167,21 @@ typedef union {
   };
 } airwell_t;
 
+static manchester_protocol_t airwell_manchester = {
+    .header_mark = 3 * 950,
+    .header_space = 3 * 950,
+    .half_period = 950,
+    .tail_mark = 4 * 950,
+    .bits = 34,
+    .repeat = 3,
+};
+
+static ir_protocol_t airwell_protocol = {
+    .name = "Airwell",
+    .coding = IR_CODING_MANCHESTER,
+    .manchester = &airwell_manchester,
+};
+
 static value_mode_t airwell_modes[] = {
     { 1, AC_MODE_COOL },
     { 2, AC_MODE_HEAT },
@@ -132,57 +199,60 @@ static value_mode_t airwell_fans[] = {
     { -1, AC_MODE_AUTO },
 };
 
-static int airwell_ir_recv(rmt_symbol_word_t *symbols, size_t len)
+#define AIRWELL_MIN_TEMPERATURE 16
+#define AIRWELL_MAX_TEMPERATURE 30
+
+static ac_reject_t airwell_validate(uint64_t frame)
 {
-    airwell_t airwell =
-        { .raw = parse_manchester(symbols, len, 3 * 950, 3 * 950, 950) };
+    airwell_t airwell = { .raw = frame };
 
-    ESP_LOGD(TAG, "Parsed value: 0x%" PRIx64, airwell.raw);
-    if (!airwell.raw)
-        return -1;
+    if (!airwell.one)
+        return AC_REJECT_STRUCTURE;
 
-    update_state(airwell.power_toggle ? !current_state.power : -1,
-        airwell.temp + 15, value_to_mode(airwell_modes, airwell.mode),
-        value_to_mode(airwell_fans, airwell.fan));
+    if (airwell.temp + 15 < AIRWELL_MIN_TEMPERATURE ||
+        airwell.temp + 15 > AIRWELL_MAX_TEMPERATURE ||
+        value_to_mode(airwell_modes, airwell.mode) == -1)
+    {
+        return AC_REJECT_RANGE;
+    }
+
+    return AC_REJECT_NONE;
+}
+
+static int airwell_decode(uint64_t frame, const ac_state_t *state,
+    ac_update_t *update)
+{
+    airwell_t airwell = { .raw = frame };
+
+    update->power = airwell.power_toggle ? !state->power : -1;
+    update->temperature = airwell.temp + 15;
+    update->mode = value_to_mode(airwell_modes, airwell.mode);
+    update->fan = value_to_mode(airwell_fans, airwell.fan);
 
     return 0;
 }
 
-static int airwell_ir_send()
+static uint64_t airwell_encode(const ac_state_t *state)
 {
-    int ret;
-    size_t len;
-    rmt_symbol_word_t *symbols = NULL;
     airwell_t airwell = {
         .one = 1,
-        .temp = current_state.temperature - 15,
-        .fan = mode_to_value(airwell_fans, current_state.fan),
-        .mode = mode_to_value(airwell_modes, current_state.mode),
-        .power_toggle = current_state.detected_power != current_state.power,
+        .temp = state->temperature - 15,
+        .fan = mode_to_value(airwell_fans, state->fan),
+        .mode = mode_to_value(airwell_modes, state->mode),
+        .power_toggle = state->detected_power != state->power,
     };
 
-    if (current_state.power == 0 && current_state.detected_power == 0)
-        return 0;
-
-    ESP_LOGI(TAG, "Transmitting value: 0x%" PRIx64, airwell.raw);
-    if (generate_manchester(3 * 950, 3 * 950, 3, 4 * 950, 950, airwell.raw,
-        &symbols, &len))
-    {
-        ESP_LOGE(TAG, "Failed generating IR symbols");
-        return -1;
-    }
-    ret = ir_send(symbols, len);
-
-    free(symbols);
-    return ret;
+    return airwell.raw;
 }
 
 static ac_ops_t airwell = {
     .name = "Airwell",
-    .ir_recv = airwell_ir_recv,
-    .ir_send = airwell_ir_send,
-    .min_temperature = 16,
-    .max_temperature = 30,
+    .protocol = &airwell_protocol,
+    .validate = airwell_validate,
+    .decode = airwell_decode,
+    .encode = airwell_encode,
+    .min_temperature = AIRWELL_MIN_TEMPERATURE,
+    .max_temperature = AIRWELL_MAX_TEMPERATURE,
     .supported_fans = (ac_fan_t[]){ AC_FAN_LOW, AC_FAN_MEDIUM, AC_FAN_HIGH, AC_FAN_AUTO, -1 },
     .supported_modes = (ac_mode_t[]){ AC_MODE_COOL, AC_MODE_HEAT, AC_MODE_AUTO, AC_MODE_DRY, AC_MODE_FAN, -1 },
 };
@@ -193,24 +263,129 @@ static ac_ops_t *acs[] = {
     NULL
 };
 
-void ac_set_on_power_changed_cb(ac_on_power_changed_t cb)
+/* Learning mode, the AC is detected by scoring the remote's frames */
+#define AC_LEARN_FRAMES 3
+
+static uint8_t is_learning = 0;
+static unsigned int learn_frames = 0;
+static unsigned int learn_scores[sizeof(acs) / sizeof(*acs)] = {};
+
+static ac_ops_t *ac_learn(ir_protocol_t *protocol, uint64_t frame)
+{
+    ac_ops_t *best = NULL;
+    unsigned int best_score = 0;
+    ac_update_t update;
+    int i;
+
+    for (i = 0; acs[i]; i++)
+    {
+        if (acs[i]->protocol == protocol &&
+            acs[i]->validate(frame) == AC_REJECT_NONE &&
+            !acs[i]->decode(frame, &current_state, &update))
+        {
+            learn_scores[i]++;
+        }
+    }
+
+    if (++learn_frames < AC_LEARN_FRAMES)
+        return NULL;
+
+    for (i = 0; acs[i]; i++)
+    {
+        if (learn_scores[i] <= best_score)
+            continue;
+        best = acs[i];
+        best_score = learn_scores[i];
+    }
+
+    /* Most frames must agree on the AC, otherwise start over */
+    if (best_score <= AC_LEARN_FRAMES / 2)
+    {
+        ESP_LOGW(TAG, "No AC matched the last %d frames", AC_LEARN_FRAMES);
+        best = NULL;
+    }
+
+    learn_frames = 0;
+    memset(learn_scores, 0, sizeof(learn_scores));
+    return best;
+}
+
+void ac_set_on_state_changed_cb(ac_on_state_changed_t cb)
 {
-    on_power_changed_cb = cb;
+    on_state_changed_cb = cb;
 }
 
-void ac_set_on_temperature_changed_cb(ac_on_temperature_changed_t cb)
+const char *ac_reject_to_str(ac_reject_t reason)
 {
-    on_temperature_changed_cb = cb;
+    switch (reason)
+    {
+    case AC_REJECT_NONE: return "None";
+    case AC_REJECT_STRUCTURE: return "Structure";
+    case AC_REJECT_RANGE: return "Range";
+    case AC_REJECT_CHECKSUM: return "Checksum";
+    case AC_REJECT_MAX: break;
+    }
+
+    return "Invalid";
+}
+
+uint32_t ac_get_rejected_frames(ac_reject_t reason)
+{
+    return reason < AC_REJECT_MAX ? rejected_frames[reason] : 0;
 }
 
-void ac_set_on_mode_changed_cb(ac_on_mode_changed_t cb)
+void ac_transaction_begin(void)
 {
-    on_mode_changed_cb = cb;
+    transaction_depth++;
 }
 
-void ac_set_on_fan_changed_cb(ac_on_fan_changed_t cb)
+void ac_transaction_end(void)
 {
-    on_fan_changed_cb = cb;
+    if (!transaction_depth || --transaction_depth)
+        return;
+
+    commit_state();
+}
+
+const char *ac_get_model(void)
+{
+    return ac_ops ? ac_ops->name : NULL;
+}
+
+static void ac_capabilities_add(const ac_ops_t *ops,
+    ac_capabilities_t *capabilities)
+{
+    ac_mode_t *mode;
+    ac_fan_t *fan;
+
+    if (ops->min_temperature < capabilities->min_temperature)
+        capabilities->min_temperature = ops->min_temperature;
+    if (ops->max_temperature > capabilities->max_temperature)
+        capabilities->max_temperature = ops->max_temperature;
+
+    for (mode = ops->supported_modes; *mode != -1; mode++)
+        capabilities->modes |= 1 << *mode;
+    for (fan = ops->supported_fans; *fan != -1; fan++)
+        capabilities->fans |= 1 << *fan;
+}
+
+void ac_get_capabilities(ac_capabilities_t *capabilities)
+{
+    ac_ops_t **iter;
+
+    capabilities->min_temperature = INT_MAX;
+    capabilities->max_temperature = INT_MIN;
+    capabilities->modes = 0;
+    capabilities->fans = 0;
+
+    if (ac_ops)
+    {
+        ac_capabilities_add(ac_ops, capabilities);
+        return;
+    }
+
+    for (iter = acs; *iter; iter++)
+        ac_capabilities_add(*iter, capabilities);
 }
 
 bool ac_get_power(void)
@@ -237,7 +412,7 @@ void ac_set_detected_power(bool on)
 {
     current_state.detected_power = on;
     if (current_state.detected_power != current_state.power)
-        ac_ir_send();
+        ac_ir_send(0);
 }
 
 int ac_set_power(bool on)
@@ -248,7 +423,7 @@ int ac_set_power(bool on)
 
 int ac_set_temperature(int temperature)
 {
-    if (temperature < ac_ops->min_temperature ||
+    if (!ac_ops || temperature < ac_ops->min_temperature ||
         temperature > ac_ops->max_temperature)
     {
         return -1;
@@ -260,6 +435,9 @@ int ac_set_temperature(int temperature)
 
 int ac_set_mode(ac_mode_t mode)
 {
+    if (!ac_ops)
+        return -1;
+
     for (ac_mode_t *iter = ac_ops->supported_modes; *iter != -1; iter++)
     {
         if (*iter == mode)
@@ -273,6 +451,9 @@ int ac_set_mode(ac_mode_t mode)
 
 int ac_set_fan(ac_fan_t fan)
 {
+    if (!ac_ops)
+        return -1;
+
     for (ac_fan_t *iter = ac_ops->supported_fans; *iter != -1; iter++)
     {
         if (*iter == fan)
@@ -284,26 +465,209 @@ int ac_set_fan(ac_fan_t fan)
     return -1;
 }
 
-int ac_ir_recv(rmt_symbol_word_t *symbols, size_t len)
+static bool is_duplicate(const ac_frame_t *frame)
+{
+    bool duplicate = frame->protocol == last_protocol &&
+        frame->value == last_frame &&
+        frame->time - last_frame_time < AC_DUPLICATE_WINDOW_US;
+
+    if (duplicate)
+        return true;
+
+    last_protocol = frame->protocol;
+    last_frame = frame->value;
+    last_frame_time = frame->time;
+
+    return false;
+}
+
+static int ac_ir_check(ac_frame_t *frame)
+{
+    ac_reject_t reason;
+
+    if (!ac_ops || frame->protocol != ac_ops->protocol)
+    {
+        ESP_LOGI(TAG, "Ignoring %s frame", frame->protocol->name);
+        return -1;
+    }
+
+    /* A malformed frame must not reach the state, NVS or MQTT */
+    if ((reason = ac_ops->validate(frame->value)) != AC_REJECT_NONE)
+    {
+        ESP_LOGW(TAG, "Rejected %s frame 0x%" PRIx64 ": %s", ac_ops->name,
+            frame->value, ac_reject_to_str(reason));
+        rejected_frames[reason]++;
+        return -1;
+    }
+
+    if (is_duplicate(frame))
+    {
+        ESP_LOGD(TAG, "Dropping duplicate %s frame", frame->protocol->name);
+        return 1;
+    }
+
+    frame->checked = 1;
+    return 0;
+}
+
+int ac_ir_decode(rmt_symbol_word_t *symbols, size_t len, int64_t time,
+    ac_frame_t *frame)
+{
+    frame->time = time;
+    frame->checked = 0;
+    if (!(frame->protocol = ir_decoder_decode(symbols, len, &frame->value)))
+        return -1;
+
+    ESP_LOGD(TAG, "Parsed %s value: 0x%" PRIx64, frame->protocol->name,
+        frame->value);
+
+    /* While learning, all frames are left for ac_ir_apply() to score */
+    if (is_learning)
+        return 0;
+
+    return ac_ir_check(frame);
+}
+
+int ac_ir_apply(ac_frame_t *frame)
+{
+    ac_update_t update;
+    int ret;
+
+    if (!frame->checked)
+    {
+        if (is_learning)
+        {
+            if (!(ac_ops = ac_learn(frame->protocol, frame->value)))
+                return -1;
+
+            ESP_LOGI(TAG, "Learned AC protocol: %s", ac_ops->name);
+            config_ac_learned_protocol_set(ac_ops->name);
+            is_learning = 0;
+            /* Reported along with the state the frame carries */
+            pending_changes |= AC_CHANGED_MODEL;
+        }
+
+        if ((ret = ac_ir_check(frame)))
+            return ret;
+    }
+
+    if (ac_ops->decode(frame->value, &current_state, &update))
+        return -1;
+
+    update_state(update.power, update.temperature, update.mode, update.fan);
+    return 0;
+}
+
+int ac_ir_recv(rmt_symbol_word_t *symbols, size_t len, int64_t time)
 {
-    return ac_ops->ir_recv(symbols, len);
+    ac_frame_t frame;
+    int ret;
+
+    if ((ret = ac_ir_decode(symbols, len, time, &frame)))
+        return ret;
+
+    return ac_ir_apply(&frame);
+}
+
+int ac_ir_passthrough(const ac_frame_t *frame, int64_t origin)
+{
+    if (!frame->checked || frame->protocol->coding != IR_CODING_MANCHESTER)
+        return -1;
+
+    ESP_LOGI(TAG, "Passing through value: 0x%" PRIx64, frame->value);
+    return ir_send_manchester(frame->protocol->manchester, frame->value,
+        origin);
+}
+
+int ac_ir_send(int64_t origin)
+{
+    uint64_t frame;
+
+    if (!ac_ops)
+        return -1;
+
+    if (current_state.power == 0 && current_state.detected_power == 0)
+        return 0;
+
+    /* Only Manchester frames can be streamed for now */
+    if (ac_ops->protocol->coding != IR_CODING_MANCHESTER)
+        return -1;
+
+    frame = ac_ops->encode(&current_state);
+    ESP_LOGI(TAG, "Transmitting value: 0x%" PRIx64, frame);
+    return ir_send_manchester(ac_ops->protocol->manchester, frame, origin);
 }
 
-int ac_ir_send(void)
+ac_replay_result_t ac_ir_replay(const rmt_symbol_word_t *symbols, size_t len,
+    uint8_t tolerance)
 {
-    return ac_ops->ir_send();
+    manchester_protocol_t protocol;
+    ac_state_t state = {};
+    ac_update_t update;
+    uint64_t frame;
+
+    if (!ac_ops || ac_ops->protocol->coding != IR_CODING_MANCHESTER)
+        return AC_REPLAY_FAILED;
+
+    /* A private copy, the live decoder's windows are left untouched */
+    protocol = *ac_ops->protocol->manchester;
+    protocol.tolerance = tolerance;
+    protocol.adaptive.enabled = 0;
+    manchester_protocol_init(&protocol);
+
+    if (!(frame = parse_manchester(&protocol, (rmt_symbol_word_t *)symbols,
+        len)) || ac_ops->validate(frame) != AC_REJECT_NONE ||
+        ac_ops->decode(frame, &state, &update))
+    {
+        return AC_REPLAY_FAILED;
+    }
+
+    /* A scratch state, the live one is left untouched */
+    merge_state(&state, update.power, update.temperature, update.mode,
+        update.fan);
+
+    if (manchester_compare(&protocol, ac_ops->encode(&state), symbols, len))
+        return AC_REPLAY_MISMATCHED;
+
+    return AC_REPLAY_MATCHED;
 }
 
 int ac_initialize(const char *model)
 {
+    const char *learned = NULL;
     ac_ops_t **iter;
 
+    /* A previously learned AC spares another learning session */
+    if (!strcasecmp(model, "auto") &&
+        (learned = config_ac_learned_protocol_get()))
+    {
+        model = learned;
+    }
+
     for (iter = acs; iter && *iter; iter++)
     {
-        if (strcasecmp(model, (*iter)->name))
-            continue;
-        ac_ops = *iter;
-        break;
+        if ((*iter)->protocol->coding == IR_CODING_MANCHESTER)
+        {
+            (*iter)->protocol->manchester->adaptive.enabled =
+                config_ac_adaptive_timing_get();
+        }
+
+        /* Frames of other ACs are recognized, but not acted upon */
+        if (ir_decoder_register((*iter)->protocol))
+            return -1;
+
+        if (!ac_ops && !strcasecmp(model, (*iter)->name))
+            ac_ops = *iter;
+    }
+
+    current_state.data = config_ac_persistent_load();
+
+    if (!ac_ops && (learned || !strcasecmp(model, "auto")))
+    {
+        ESP_LOGI(TAG, "Learning AC protocol from the next %d frames",
+            AC_LEARN_FRAMES);
+        is_learning = 1;
+        return 0;
     }
 
     if (!ac_ops)
@@ -312,6 +676,5 @@ int ac_initialize(const char *model)
         return -1;
     }
 
-    current_state.data = config_ac_persistent_load();
     return 0;
 }
@@ -1,8 +1,10 @@
 #ifndef AC_H
 #define AC_H
 
+#include "ir_decoder.h"
 #include <driver/rmt_types.h>
 #include <stddef.h>
+#include <stdint.h>
 
 typedef enum {
     AC_MODE_FAN,
@@ -19,31 +21,97 @@ typedef enum {
     AC_FAN_AUTO,
 } ac_fan_t;
 
+typedef enum {
+    AC_CHANGED_POWER = 1 << 0,
+    AC_CHANGED_TEMPERATURE = 1 << 1,
+    AC_CHANGED_MODE = 1 << 2,
+    AC_CHANGED_FAN = 1 << 3,
+    /* The AC protocol was learned, along with its capabilities */
+    AC_CHANGED_MODEL = 1 << 4,
+} ac_changed_t;
+
+/* Reasons for rejecting a decoded frame */
+typedef enum {
+    AC_REJECT_NONE = 0,
+    AC_REJECT_STRUCTURE,
+    AC_REJECT_RANGE,
+    AC_REJECT_CHECKSUM,
+    AC_REJECT_MAX,
+} ac_reject_t;
+
+typedef enum {
+    AC_REPLAY_MATCHED,
+    AC_REPLAY_MISMATCHED,
+    AC_REPLAY_FAILED,
+} ac_replay_result_t;
+
+/* A decoded capture, on its way to the AC state */
+typedef struct {
+    ir_protocol_t *protocol;
+    uint64_t value;
+    /* When it was captured, repeats of a burst are told apart by it */
+    int64_t time;
+    /* Matched the AC, passed validation and isn't a duplicate */
+    uint8_t checked;
+} ac_frame_t;
+
+/* What an AC supports, modes and fans are bitmasks of (1 << ac_mode_t) and
+ * (1 << ac_fan_t) */
+typedef struct {
+    int min_temperature;
+    int max_temperature;
+    uint32_t modes;
+    uint32_t fans;
+} ac_capabilities_t;
+
 /* Event callback types */
-typedef void (*ac_on_power_changed_t)(bool on);
-typedef void (*ac_on_temperature_changed_t)(int temperature);
-typedef void (*ac_on_mode_changed_t)(ac_mode_t mode);
-typedef void (*ac_on_fan_changed_t)(ac_fan_t fan);
+/* Called once per state transaction with a bitmask of ac_changed_t */
+typedef void (*ac_on_state_changed_t)(uint32_t changed);
 
 /* Event handlers */
-void ac_set_on_power_changed_cb(ac_on_power_changed_t cb);
-void ac_set_on_temperature_changed_cb(ac_on_temperature_changed_t cb);
-void ac_set_on_mode_changed_cb(ac_on_mode_changed_t cb);
-void ac_set_on_fan_changed_cb(ac_on_fan_changed_t cb);
+void ac_set_on_state_changed_cb(ac_on_state_changed_t cb);
 
+const char *ac_reject_to_str(ac_reject_t reason);
+uint32_t ac_get_rejected_frames(ac_reject_t reason);
+
+/* NULL while the AC protocol is being learned */
+const char *ac_get_model(void);
+/* While the AC protocol is being learned, covers all supported ACs */
+void ac_get_capabilities(ac_capabilities_t *capabilities);
 bool ac_get_power(void);
 int ac_get_temperature(void);
 ac_mode_t ac_get_mode(void);
 ac_fan_t ac_get_fan(void);
 
+/* Group several state updates into a single notification and NVS write */
+void ac_transaction_begin(void);
+void ac_transaction_end(void);
+
 void ac_set_detected_power(bool on);
 int ac_set_power(bool on);
 int ac_set_temperature(int temperature);
 int ac_set_mode(ac_mode_t mode);
 int ac_set_fan(ac_fan_t mode);
 
-int ac_ir_recv(rmt_symbol_word_t *symbols, size_t len);
-int ac_ir_send(void);
+/* Returns 0 if the frame was applied, 1 if it repeats the burst of the
+ * previous one and was dropped, or -1 on failure. The time is the capture's,
+ * as returned by ir_recv_time_get() */
+int ac_ir_recv(rmt_symbol_word_t *symbols, size_t len, int64_t time);
+/* The two halves of ac_ir_recv(). Decoding doesn't touch the AC state and may
+ * run outside the AC task once the protocol is learned, as long as it always
+ * runs in the same task */
+int ac_ir_decode(rmt_symbol_word_t *symbols, size_t len, int64_t time,
+    ac_frame_t *frame);
+int ac_ir_apply(ac_frame_t *frame);
+/* Retransmits a checked frame as is, before it's applied to the AC state */
+int ac_ir_passthrough(const ac_frame_t *frame, int64_t origin);
+/* The origin is the time of the capture that triggered it, or 0 */
+int ac_ir_send(int64_t origin);
+/* Decodes and re-encodes a captured frame with the given timing tolerance,
+ * without touching the AC state */
+ac_replay_result_t ac_ir_replay(const rmt_symbol_word_t *symbols, size_t len,
+    uint8_t tolerance);
+/* A model of "auto" learns the AC protocol from the remote's frames */
 int ac_initialize(const char *model);
 
 #endif
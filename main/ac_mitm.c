@@ -1,15 +1,22 @@
 #include "ac.h"
+#include "capture.h"
 #include "config.h"
+#include "discovery.h"
 #include "eth.h"
 #include "hal/rmt_types.h"
 #include "httpd.h"
 #include "ir.h"
+#include "ir_decoder.h"
+#include "latency.h"
 #include "log.h"
+#include "metrics.h"
 #include "mqtt.h"
 #include "ota.h"
 #include "power_detector.h"
 #include "resolve.h"
+#include "topics.h"
 #include "wifi.h"
+#include <cJSON.h>
 #include <esp_err.h>
 #include <esp_log.h>
 #include <esp_system.h>
@@ -17,6 +24,7 @@
 #include <nvs.h>
 #include <nvs_flash.h>
 #include <mdns.h>
+#include <stdatomic.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
 #include <freertos/task.h>
@@ -25,7 +33,12 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define MAX_TOPIC_LEN 256
+#define EVENT_QUEUE_LENGTH 16
+/* Slots only events that wait for one may take, so timer events can't crowd
+ * them out */
+#define EVENT_QUEUE_RESERVED_SLOTS 6
+/* Longer would stall the MQTT client, and its keepalive with it */
+#define EVENT_QUEUE_MQTT_TIMEOUT_MS 1000
 static const char *TAG = "AC-MITM";
 
 typedef struct {
@@ -106,15 +119,85 @@ static const char *device_name_get(void)
 
 static void reset(void)
 {
+    config_ac_persistent_flush();
+    mqtt_offline_queue_sync();
     wifi_disconnect();
     abort();
 }
 
 /* Bookkeeping functions */
+static void event_queue_stats_get(unsigned int *depth,
+    unsigned int *high_water_mark, unsigned int *dropped);
+static uint32_t ir_sends_coalesced_get(void);
+
+static void decoder_stats_publish(const ir_protocol_t *protocol, void *ctx)
+{
+    char buf[24];
+    uint32_t attempts = protocol->stats.decoded + protocol->stats.failed;
+
+    /* Registered after the topics were built */
+    if (!topic_decoder_get(protocol, TOPIC_DECODER_DECODED))
+        return;
+
+    sprintf(buf, "%" PRIu32, protocol->stats.decoded);
+    mqtt_publish(topic_decoder_get(protocol, TOPIC_DECODER_DECODED),
+        (uint8_t *)buf, strlen(buf), config_mqtt_qos_get(),
+        config_mqtt_retained_get());
+    sprintf(buf, "%" PRIu32, protocol->stats.failed);
+    mqtt_publish(topic_decoder_get(protocol, TOPIC_DECODER_FAILED),
+        (uint8_t *)buf, strlen(buf), config_mqtt_qos_get(),
+        config_mqtt_retained_get());
+
+    /* Decode time (in microseconds) */
+    sprintf(buf, "%" PRIu64,
+        attempts ? protocol->stats.total_time_us / attempts : 0);
+    mqtt_publish(topic_decoder_get(protocol, TOPIC_DECODER_AVG_DECODE_TIME),
+        (uint8_t *)buf, strlen(buf), config_mqtt_qos_get(),
+        config_mqtt_retained_get());
+    sprintf(buf, "%" PRIu32, protocol->stats.max_time_us);
+    mqtt_publish(topic_decoder_get(protocol, TOPIC_DECODER_MAX_DECODE_TIME),
+        (uint8_t *)buf, strlen(buf), config_mqtt_qos_get(),
+        config_mqtt_retained_get());
+
+    if (protocol->coding != IR_CODING_MANCHESTER ||
+        !protocol->manchester->adaptive.enabled)
+    {
+        return;
+    }
+
+    /* Adaptive timing, estimates are in microseconds */
+    sprintf(buf, "%u", protocol->manchester->adaptive.tolerance);
+    mqtt_publish(topic_decoder_get(protocol, TOPIC_DECODER_TOLERANCE),
+        (uint8_t *)buf, strlen(buf), config_mqtt_qos_get(),
+        config_mqtt_retained_get());
+    sprintf(buf, "%" PRIu32, protocol->manchester->adaptive.half_period >>
+        MANCHESTER_ADAPTIVE_FRACTION_BITS);
+    mqtt_publish(topic_decoder_get(protocol, TOPIC_DECODER_HALF_PERIOD),
+        (uint8_t *)buf, strlen(buf), config_mqtt_qos_get(),
+        config_mqtt_retained_get());
+    sprintf(buf, "%" PRIu32, protocol->manchester->adaptive.header_mark >>
+        MANCHESTER_ADAPTIVE_FRACTION_BITS);
+    mqtt_publish(topic_decoder_get(protocol, TOPIC_DECODER_HEADER_MARK),
+        (uint8_t *)buf, strlen(buf), config_mqtt_qos_get(),
+        config_mqtt_retained_get());
+    sprintf(buf, "%" PRIu32, protocol->manchester->adaptive.header_space >>
+        MANCHESTER_ADAPTIVE_FRACTION_BITS);
+    mqtt_publish(topic_decoder_get(protocol, TOPIC_DECODER_HEADER_SPACE),
+        (uint8_t *)buf, strlen(buf), config_mqtt_qos_get(),
+        config_mqtt_retained_get());
+}
+
 static void heartbeat_publish(void)
 {
-    char topic[MAX_TOPIC_LEN];
     char buf[16];
+    char *payload;
+    unsigned int depth, high_water_mark, dropped;
+    ac_reject_t reason;
+    uint32_t ir_decoded, ir_failed;
+    metrics_heap_t heap;
+    mqtt_offline_stats_t offline;
+    latency_stats_t press_to_tx;
+    cJSON *latency, *tasks;
 
     /* Only publish uptime when connected, we don't want it to be queued */
     if (!mqtt_is_connected())
@@ -122,46 +205,180 @@ static void heartbeat_publish(void)
 
     /* Uptime (in seconds) */
     sprintf(buf, "%" PRId64, esp_timer_get_time() / 1000 / 1000);
-    snprintf(topic, MAX_TOPIC_LEN, "%s/Uptime", device_name_get());
-    mqtt_publish(topic, (uint8_t *)buf, strlen(buf), config_mqtt_qos_get(),
-        config_mqtt_retained_get());
+    mqtt_publish(topic_get(TOPIC_UPTIME), (uint8_t *)buf, strlen(buf),
+        config_mqtt_qos_get(), config_mqtt_retained_get());
 
-    /* Free memory (in bytes) */
-    sprintf(buf, "%" PRIu32, esp_get_free_heap_size());
-    snprintf(topic, MAX_TOPIC_LEN, "%s/FreeMemory", device_name_get());
-    mqtt_publish(topic, (uint8_t *)buf, strlen(buf), config_mqtt_qos_get(),
-        config_mqtt_retained_get());
+    /* Free memory, the lowest it's been and the largest block that can be
+     * allocated, i.e. fragmentation (in bytes) */
+    metrics_heap_get(&heap);
+    sprintf(buf, "%" PRIu32, heap.free);
+    mqtt_publish(topic_get(TOPIC_FREE_MEMORY), (uint8_t *)buf, strlen(buf),
+        config_mqtt_qos_get(), config_mqtt_retained_get());
+    sprintf(buf, "%" PRIu32, heap.min_free);
+    mqtt_publish(topic_get(TOPIC_MIN_FREE_MEMORY), (uint8_t *)buf, strlen(buf),
+        config_mqtt_qos_get(), config_mqtt_retained_get());
+    sprintf(buf, "%" PRIu32, heap.largest_free_block);
+    mqtt_publish(topic_get(TOPIC_LARGEST_FREE_BLOCK), (uint8_t *)buf,
+        strlen(buf), config_mqtt_qos_get(), config_mqtt_retained_get());
+
+    /* Stack and CPU usage of the application's tasks */
+    tasks = metrics_tasks_to_json();
+    if ((payload = cJSON_PrintUnformatted(tasks)))
+    {
+        mqtt_publish(topic_get(TOPIC_DIAGNOSTICS_TASKS), (uint8_t *)payload,
+            strlen(payload), config_mqtt_qos_get(), config_mqtt_retained_get());
+        cJSON_free(payload);
+    }
+    cJSON_Delete(tasks);
+
+    /* AC protocol, changes once learned */
+    payload = (char *)(ac_get_model() ? : "learning");
+    mqtt_publish(topic_get(TOPIC_PROTOCOL), (uint8_t *)payload, strlen(payload),
+        config_mqtt_qos_get(), config_mqtt_retained_get());
+
+    /* AC state flash commits */
+    sprintf(buf, "%" PRIu32, config_ac_persistent_commits_get());
+    mqtt_publish(topic_get(TOPIC_FLASH_COMMITS), (uint8_t *)buf, strlen(buf),
+        config_mqtt_qos_get(), config_mqtt_retained_get());
+
+    /* Event queue statistics */
+    event_queue_stats_get(&depth, &high_water_mark, &dropped);
+    sprintf(buf, "%u", depth);
+    mqtt_publish(topic_get(TOPIC_EVENT_QUEUE_DEPTH), (uint8_t *)buf,
+        strlen(buf), config_mqtt_qos_get(), config_mqtt_retained_get());
+    sprintf(buf, "%u", high_water_mark);
+    mqtt_publish(topic_get(TOPIC_EVENT_QUEUE_HIGH_WATER_MARK), (uint8_t *)buf,
+        strlen(buf), config_mqtt_qos_get(), config_mqtt_retained_get());
+    sprintf(buf, "%u", dropped);
+    mqtt_publish(topic_get(TOPIC_EVENT_QUEUE_DROPPED), (uint8_t *)buf,
+        strlen(buf), config_mqtt_qos_get(), config_mqtt_retained_get());
+
+    /* Decoded frames rejected by the AC's validation */
+    for (reason = AC_REJECT_NONE + 1; reason < AC_REJECT_MAX; reason++)
+    {
+        sprintf(buf, "%" PRIu32, ac_get_rejected_frames(reason));
+        mqtt_publish(topic_rejected_frames_get(reason), (uint8_t *)buf,
+            strlen(buf), config_mqtt_qos_get(), config_mqtt_retained_get());
+    }
+
+    /* IR decoder statistics, in total and per-protocol */
+    ir_decoder_frames_get(&ir_decoded, &ir_failed);
+    sprintf(buf, "%" PRIu32, ir_decoded);
+    mqtt_publish(topic_get(TOPIC_IR_DECODED), (uint8_t *)buf, strlen(buf),
+        config_mqtt_qos_get(), config_mqtt_retained_get());
+    sprintf(buf, "%" PRIu32, ir_failed);
+    mqtt_publish(topic_get(TOPIC_IR_FAILED), (uint8_t *)buf, strlen(buf),
+        config_mqtt_qos_get(), config_mqtt_retained_get());
+    ir_decoder_foreach(decoder_stats_publish, NULL);
+
+    /* IR transmissions folded into a later one by the send delay */
+    sprintf(buf, "%" PRIu32, ir_sends_coalesced_get());
+    mqtt_publish(topic_get(TOPIC_IR_SENDS_COALESCED), (uint8_t *)buf,
+        strlen(buf), config_mqtt_qos_get(), config_mqtt_retained_get());
+
+    /* MQTT publications the client refused, e.g. its outbox was full */
+    sprintf(buf, "%" PRIu32, mqtt_publish_failures_get());
+    mqtt_publish(topic_get(TOPIC_MQTT_PUBLISH_FAILURES), (uint8_t *)buf,
+        strlen(buf), config_mqtt_qos_get(), config_mqtt_retained_get());
+
+    /* Publications made while disconnected from the broker */
+    mqtt_offline_stats_get(&offline);
+    sprintf(buf, "%" PRIu32, offline.replaced);
+    mqtt_publish(topic_get(TOPIC_MQTT_OFFLINE_QUEUE_REPLACED), (uint8_t *)buf,
+        strlen(buf), config_mqtt_qos_get(), config_mqtt_retained_get());
+    sprintf(buf, "%" PRIu32, offline.dropped);
+    mqtt_publish(topic_get(TOPIC_MQTT_OFFLINE_QUEUE_DROPPED), (uint8_t *)buf,
+        strlen(buf), config_mqtt_qos_get(), config_mqtt_retained_get());
+    sprintf(buf, "%" PRIu32, offline.replayed);
+    mqtt_publish(topic_get(TOPIC_MQTT_OFFLINE_QUEUE_REPLAYED), (uint8_t *)buf,
+        strlen(buf), config_mqtt_qos_get(), config_mqtt_retained_get());
+
+    /* Latency of handling the remote's frames, from the end of the capture */
+    latency = latency_to_json();
+    if ((payload = cJSON_PrintUnformatted(latency)))
+    {
+        mqtt_publish(topic_get(TOPIC_DIAGNOSTICS_LATENCY), (uint8_t *)payload,
+            strlen(payload), config_mqtt_qos_get(), config_mqtt_retained_get());
+        cJSON_free(payload);
+    }
+    cJSON_Delete(latency);
+
+    /* Time from the end of a remote's capture to the end of its transmission
+     * to the AC (in microseconds) */
+    latency_stats_get(LATENCY_STAGE_TX_DONE, &press_to_tx);
+    if (!press_to_tx.count)
+        return;
+    sprintf(buf, "%" PRIu32, press_to_tx.avg_us);
+    mqtt_publish(topic_get(TOPIC_LATENCY_AVG_PRESS_TO_TX), (uint8_t *)buf,
+        strlen(buf), config_mqtt_qos_get(), config_mqtt_retained_get());
+    sprintf(buf, "%" PRIu32, press_to_tx.max_us);
+    mqtt_publish(topic_get(TOPIC_LATENCY_MAX_PRESS_TO_TX), (uint8_t *)buf,
+        strlen(buf), config_mqtt_qos_get(), config_mqtt_retained_get());
 }
 
 static void self_publish(void)
 {
-    char topic[MAX_TOPIC_LEN];
     char *payload;
 
     /* Current status */
     payload = "online";
-    snprintf(topic, MAX_TOPIC_LEN, "%s/Status", device_name_get());
-    mqtt_publish(topic, (uint8_t *)payload, strlen(payload),
+    mqtt_publish(topic_get(TOPIC_STATUS), (uint8_t *)payload, strlen(payload),
         config_mqtt_qos_get(), config_mqtt_retained_get());
 
     /* App version */
     payload = AC_MITM_VER;
-    snprintf(topic, MAX_TOPIC_LEN, "%s/Version", device_name_get());
-    mqtt_publish(topic, (uint8_t *)payload, strlen(payload),
+    mqtt_publish(topic_get(TOPIC_VERSION), (uint8_t *)payload, strlen(payload),
         config_mqtt_qos_get(), config_mqtt_retained_get());
 
     /* Config version */
     payload = config_version_get();
-    snprintf(topic, MAX_TOPIC_LEN, "%s/ConfigVersion", device_name_get());
-    mqtt_publish(topic, (uint8_t *)payload, strlen(payload),
-        config_mqtt_qos_get(), config_mqtt_retained_get());
+    mqtt_publish(topic_get(TOPIC_CONFIG_VERSION), (uint8_t *)payload,
+        strlen(payload), config_mqtt_qos_get(), config_mqtt_retained_get());
 
     heartbeat_publish();
 }
 
+/* Home Assistant discovery, limited to what the AC supports */
+static void discovery_publish(void)
+{
+    const char *modes[sizeof(mode_to_name) / sizeof(*mode_to_name) + 1];
+    const char *fans[sizeof(fan_to_name) / sizeof(*fan_to_name)];
+    discovery_climate_t climate = { .modes = modes, .fans = fans };
+    ac_capabilities_t capabilities;
+    value_name_t *value_name;
+    int i;
+
+    if (!config_mqtt_discovery_enabled_get())
+        return;
+
+    ac_get_capabilities(&capabilities);
+    climate.model = ac_get_model();
+    climate.min_temperature = capabilities.min_temperature;
+    climate.max_temperature = capabilities.max_temperature;
+
+    /* Turning off is a mode, as on the Mode topic */
+    i = 0;
+    modes[i++] = "off";
+    for (value_name = mode_to_name; value_name->name; value_name++)
+    {
+        if (capabilities.modes & (1 << value_name->value))
+            modes[i++] = value_name->name;
+    }
+    modes[i] = NULL;
+
+    i = 0;
+    for (value_name = fan_to_name; value_name->name; value_name++)
+    {
+        if (capabilities.fans & (1 << value_name->value))
+            fans[i++] = value_name->name;
+    }
+    fans[i] = NULL;
+
+    discovery_climate_publish(&climate, config_mqtt_qos_get());
+}
+
 static void publish_action()
 {
-    char topic[MAX_TOPIC_LEN];
     char *payload;
 
     if (!ac_get_power())
@@ -169,14 +386,12 @@ static void publish_action()
     else
         payload = value_to_name(action_to_name, ac_get_mode());
 
-    snprintf(topic, MAX_TOPIC_LEN, "%s/Action", device_name_get());
-    mqtt_publish(topic, (uint8_t *)payload, strlen(payload),
+    mqtt_publish(topic_get(TOPIC_ACTION), (uint8_t *)payload, strlen(payload),
         config_mqtt_qos_get(), config_mqtt_retained_get());
 }
 
 static void publish_mode()
 {
-    char topic[MAX_TOPIC_LEN];
     char *payload;
 
     if (!ac_get_power())
@@ -184,8 +399,7 @@ static void publish_mode()
     else
         payload = value_to_name(mode_to_name, ac_get_mode());
 
-    snprintf(topic, MAX_TOPIC_LEN, "%s/Mode", device_name_get());
-    mqtt_publish(topic, (uint8_t *)payload, strlen(payload),
+    mqtt_publish(topic_get(TOPIC_MODE), (uint8_t *)payload, strlen(payload),
         config_mqtt_qos_get(), config_mqtt_retained_get());
 }
 
@@ -201,14 +415,9 @@ static void ota_on_completed(ota_type_t type, ota_err_t err)
 {
     ESP_LOGI(TAG, "Update completed: %s", ota_err_to_str(err));
 
-    /* All done, restart */
-    if (err == OTA_ERR_SUCCESS)
-        reset();
-
-    /* All done, restart */
-    vTaskSuspendAll();
-    esp_restart();
-    xTaskResumeAll();
+    /* All done, restart. A failed update restarts as well, to start over
+     * from a clean state */
+    reset();
 }
 
 static void _ota_on_completed(ota_type_t type, ota_err_t err);
@@ -236,31 +445,52 @@ static void _ota_on_mqtt(const char *topic, const uint8_t *payload, size_t len,
 
 static void ota_subscribe(void)
 {
-    char topic[MAX_TOPIC_LEN];
-
     /* Register for both a specific topic for this device and a general one */
-    snprintf(topic, MAX_TOPIC_LEN, "%s/OTA/Firmware", device_name_get());
-    mqtt_subscribe(topic, 0, _ota_on_mqtt, (void *)OTA_TYPE_FIRMWARE, NULL);
-    mqtt_subscribe("AC-MITM/OTA/Firmware", 0, _ota_on_mqtt,
+    mqtt_subscribe(topic_get(TOPIC_OTA_FIRMWARE), 0, _ota_on_mqtt,
+        (void *)OTA_TYPE_FIRMWARE, NULL);
+    mqtt_subscribe(topic_get(TOPIC_ALL_OTA_FIRMWARE), 0, _ota_on_mqtt,
         (void *)OTA_TYPE_FIRMWARE, NULL);
 
-    snprintf(topic, MAX_TOPIC_LEN, "%s/OTA/Config", device_name_get());
-    mqtt_subscribe(topic, 0, _ota_on_mqtt, (void *)OTA_TYPE_CONFIG, NULL);
-    mqtt_subscribe("AC-MITM/OTA/Config", 0, _ota_on_mqtt,
+    mqtt_subscribe(topic_get(TOPIC_OTA_CONFIG), 0, _ota_on_mqtt,
+        (void *)OTA_TYPE_CONFIG, NULL);
+    mqtt_subscribe(topic_get(TOPIC_ALL_OTA_CONFIG), 0, _ota_on_mqtt,
         (void *)OTA_TYPE_CONFIG, NULL);
 }
 
 static void ota_unsubscribe(void)
 {
-    char topic[27];
+    mqtt_unsubscribe(topic_get(TOPIC_OTA_FIRMWARE));
+    mqtt_unsubscribe(topic_get(TOPIC_ALL_OTA_FIRMWARE));
+    mqtt_unsubscribe(topic_get(TOPIC_OTA_CONFIG));
+    mqtt_unsubscribe(topic_get(TOPIC_ALL_OTA_CONFIG));
+}
 
-    sprintf(topic, "%s/OTA/Firmware", device_name_get());
-    mqtt_unsubscribe(topic);
-    mqtt_unsubscribe("AC-MITM/OTA/Firmware");
+static void capture_on_mqtt(const char *topic, const uint8_t *payload,
+    size_t len, void *ctx)
+{
+    uint8_t *blob;
+    size_t blob_len;
 
-    sprintf(topic, "%s/OTA/Config", device_name_get());
-    mqtt_unsubscribe(topic);
-    mqtt_unsubscribe("AC-MITM/OTA/Config");
+    if (!(blob = capture_export(&blob_len)))
+        return;
+
+    mqtt_publish(topic_get(TOPIC_CAPTURE), blob, blob_len,
+        config_mqtt_qos_get(), 0);
+    free(blob);
+}
+
+static void _capture_on_mqtt(const char *topic, const uint8_t *payload,
+    size_t len, void *ctx);
+
+static void capture_subscribe(void)
+{
+    mqtt_subscribe(topic_get(TOPIC_CAPTURE_GET), 0, _capture_on_mqtt, NULL,
+        NULL);
+}
+
+static void capture_unsubscribe(void)
+{
+    mqtt_unsubscribe(topic_get(TOPIC_CAPTURE_GET));
 }
 
 static void _ac_on_mqtt_power(const char *topic, const uint8_t *payload,
@@ -271,55 +501,52 @@ static void _ac_on_mqtt_mode(const char *topic, const uint8_t *payload,
     size_t len, void *ctx);
 static void _ac_on_mqtt_fan(const char *topic, const uint8_t *payload,
     size_t len, void *ctx);
+static void _ac_on_mqtt_state(const char *topic, const uint8_t *payload,
+    size_t len, void *ctx);
 
 static void ac_subscribe(void)
 {
-    char topic[MAX_TOPIC_LEN];
+    mqtt_subscribe(topic_get(TOPIC_POWER_SET), 0, _ac_on_mqtt_power, NULL,
+        NULL);
+    mqtt_subscribe(topic_get(TOPIC_TEMPERATURE_SET), 0, _ac_on_mqtt_temperature,
+        NULL, NULL);
+    mqtt_subscribe(topic_get(TOPIC_MODE_SET), 0, _ac_on_mqtt_mode, NULL, NULL);
+    mqtt_subscribe(topic_get(TOPIC_FAN_SET), 0, _ac_on_mqtt_fan, NULL, NULL);
+
+    if (!config_mqtt_json_state_get())
+        return;
 
-    snprintf(topic, MAX_TOPIC_LEN, "%s/Power/Set", device_name_get());
-    mqtt_subscribe(topic, 0, _ac_on_mqtt_power, NULL, NULL);
-    snprintf(topic, MAX_TOPIC_LEN, "%s/Temperature/Set", device_name_get());
-    mqtt_subscribe(topic, 0, _ac_on_mqtt_temperature, NULL, NULL);
-    snprintf(topic, MAX_TOPIC_LEN, "%s/Mode/Set", device_name_get());
-    mqtt_subscribe(topic, 0, _ac_on_mqtt_mode, NULL, NULL);
-    snprintf(topic, MAX_TOPIC_LEN, "%s/Fan/Set", device_name_get());
-    mqtt_subscribe(topic, 0, _ac_on_mqtt_fan, NULL, NULL);
+    mqtt_subscribe(topic_get(TOPIC_STATE_SET), 0, _ac_on_mqtt_state, NULL,
+        NULL);
 }
 
 static void ac_unsubscribe(void)
 {
-    char topic[MAX_TOPIC_LEN];
-
-    snprintf(topic, MAX_TOPIC_LEN, "%s/Power/Set", device_name_get());
-    mqtt_unsubscribe(topic);
-    snprintf(topic, MAX_TOPIC_LEN, "%s/Temperature/Set", device_name_get());
-    mqtt_unsubscribe(topic);
-    snprintf(topic, MAX_TOPIC_LEN, "%s/Mode/Set", device_name_get());
-    mqtt_unsubscribe(topic);
-    snprintf(topic, MAX_TOPIC_LEN, "%s/Fan/Set", device_name_get());
-    mqtt_unsubscribe(topic);
+    mqtt_unsubscribe(topic_get(TOPIC_POWER_SET));
+    mqtt_unsubscribe(topic_get(TOPIC_TEMPERATURE_SET));
+    mqtt_unsubscribe(topic_get(TOPIC_MODE_SET));
+    mqtt_unsubscribe(topic_get(TOPIC_FAN_SET));
+    mqtt_unsubscribe(topic_get(TOPIC_STATE_SET));
 }
 
 static void cleanup(void)
 {
     ota_unsubscribe();
     ac_unsubscribe();
+    capture_unsubscribe();
 }
 
 /* Network callback functions */
 static void network_on_connected(void)
 {
-    char status_topic[MAX_TOPIC_LEN];
-
     log_start(config_log_host_get(), config_log_port_get());
     ESP_LOGI(TAG, "Connected to the network, connecting to MQTT");
-    snprintf(status_topic, MAX_TOPIC_LEN, "%s/Status", device_name_get());
 
     mqtt_connect(config_mqtt_host_get(), config_mqtt_port_get(),
         config_mqtt_client_id_get(), config_mqtt_username_get(),
         config_mqtt_password_get(), config_mqtt_ssl_get(),
         config_mqtt_server_cert_get(), config_mqtt_client_cert_get(),
-        config_mqtt_client_key_get(), status_topic, "offline",
+        config_mqtt_client_key_get(), topic_get(TOPIC_STATUS), "offline",
         config_mqtt_qos_get(), config_mqtt_retained_get());
 }
 
@@ -337,8 +564,10 @@ static void mqtt_on_connected(void)
 {
     ESP_LOGI(TAG, "Connected to MQTT");
     self_publish();
+    discovery_publish();
     ota_subscribe();
     ac_subscribe();
+    capture_subscribe();
 }
 
 static void mqtt_on_disconnected(void)
@@ -363,63 +592,164 @@ static void power_detector_changed(int pin, int level)
     ac_set_detected_power(level);
 }
 
+/* IR send scheduler, collapses bursts of commands into a single frame */
+static TimerHandle_t ir_send_timer = NULL;
+static uint32_t ir_sends_coalesced = 0;
+
+static void ac_ir_send_schedule(void)
+{
+    if (!config_ac_send_delay_get())
+    {
+        ac_ir_send(0);
+        return;
+    }
+
+    if (xTimerIsTimerActive(ir_send_timer))
+    {
+        ir_sends_coalesced++;
+        ESP_LOGD(TAG, "Coalescing IR transmission (%" PRIu32 " so far)",
+            ir_sends_coalesced);
+    }
+
+    xTimerReset(ir_send_timer, 0);
+}
+
+static uint32_t ir_sends_coalesced_get(void)
+{
+    return ir_sends_coalesced;
+}
+
+static void ac_ir_send_scheduled(void)
+{
+    /* The RMT queue is full, try again once some frames were sent */
+    if (ir_tx_in_flight_get() >= IR_TX_QUEUE_DEPTH)
+    {
+        ESP_LOGD(TAG, "%zu IR frames in flight, delaying transmission",
+            ir_tx_in_flight_get());
+        xTimerReset(ir_send_timer, 0);
+        return;
+    }
+
+    ac_ir_send(0);
+}
+
 /* IR callback functions */
-static void ir_on_recv(rmt_symbol_word_t *symbols, size_t len)
+/* The capture being applied to the AC state, state changes are reported
+ * synchronously so they can carry it to their publication */
+static int64_t state_origin = 0;
+
+static void ir_on_recv(rmt_symbol_word_t *symbols, size_t len, int64_t time)
 {
-    if (ac_ir_recv(symbols, len))
+    int ret;
+
+    latency_record(LATENCY_STAGE_DEQUEUE, time);
+    state_origin = time;
+    ret = ac_ir_recv(symbols, len, time);
+    state_origin = 0;
+    capture_add(symbols, len, ret < 0 ? CAPTURE_OUTCOME_FAILED :
+        ret ? CAPTURE_OUTCOME_DUPLICATE : CAPTURE_OUTCOME_DECODED);
+    if (ret)
         return;
 
-    ac_ir_send();
+    latency_record(LATENCY_STAGE_DECODE, time);
+
+    /* The remote's frame already carries the final state */
+    xTimerStop(ir_send_timer, 0);
+    ac_ir_send(time);
+}
+
+/* Passthrough frames were already sent from the IR task, only the state
+ * bookkeeping is left */
+static void ir_on_frame(ac_frame_t *frame, int64_t time, bool sent)
+{
+    int ret;
+
+    latency_record(LATENCY_STAGE_DEQUEUE, time);
+    state_origin = time;
+    ret = ac_ir_apply(frame);
+    state_origin = 0;
+    if (ret)
+        return;
+
+    latency_record(LATENCY_STAGE_DECODE, time);
+
+    xTimerStop(ir_send_timer, 0);
+    if (!sent)
+        ac_ir_send(time);
 }
 
 /* AC callback functions */
-static void ac_on_power_changed(bool on)
+static void publish_power(void)
 {
-    char topic[MAX_TOPIC_LEN];
-    char *payload = on ? "on" : "off";
+    char *payload = ac_get_power() ? "on" : "off";
 
-    ESP_LOGI(TAG, "AC power changed: %d", on);
-    snprintf(topic, MAX_TOPIC_LEN, "%s/Power", device_name_get());
-    mqtt_publish(topic, (uint8_t *)payload, strlen(payload),
+    mqtt_publish(topic_get(TOPIC_POWER), (uint8_t *)payload, strlen(payload),
         config_mqtt_qos_get(), config_mqtt_retained_get());
-    publish_ac();
 }
 
-static void ac_on_temperature_changed(int temperature)
+static void publish_temperature(void)
 {
-    char topic[MAX_TOPIC_LEN];
     char payload[16];
 
-    ESP_LOGI(TAG, "AC temperature changed: %dC", temperature);
-    snprintf(topic, MAX_TOPIC_LEN, "%s/Temperature", device_name_get());
-    snprintf(payload, sizeof(payload), "%d", temperature);
-    mqtt_publish(topic, (uint8_t *)payload, strlen(payload),
-        config_mqtt_qos_get(), config_mqtt_retained_get());
+    snprintf(payload, sizeof(payload), "%d", ac_get_temperature());
+    mqtt_publish(topic_get(TOPIC_TEMPERATURE), (uint8_t *)payload,
+        strlen(payload), config_mqtt_qos_get(), config_mqtt_retained_get());
 }
 
-static void ac_on_mode_changed(ac_mode_t mode)
+static void publish_fan(void)
 {
-#if 0
-    char topic[MAX_TOPIC_LEN];
-    char *payload = value_to_name(mode_to_name, mode);
+    char *payload = value_to_name(fan_to_name, ac_get_fan());
 
-    ESP_LOGI(TAG, "AC mode changed: %s", payload);
-    snprintf(topic, MAX_TOPIC_LEN, "%s/Mode", device_name_get());
-    mqtt_publish(topic, (uint8_t *)payload, strlen(payload),
+    mqtt_publish(topic_get(TOPIC_FAN), (uint8_t *)payload, strlen(payload),
         config_mqtt_qos_get(), config_mqtt_retained_get());
-#endif
-    publish_ac();
 }
 
-static void ac_on_fan_changed(ac_fan_t fan)
+static void publish_state(void)
 {
-    char topic[MAX_TOPIC_LEN];
-    char *payload = value_to_name(fan_to_name, fan);
+    char *payload;
+    cJSON *state = cJSON_CreateObject();
+
+    cJSON_AddStringToObject(state, "power", ac_get_power() ? "on" : "off");
+    cJSON_AddNumberToObject(state, "temperature", ac_get_temperature());
+    cJSON_AddStringToObject(state, "mode",
+        value_to_name(mode_to_name, ac_get_mode()));
+    cJSON_AddStringToObject(state, "fan",
+        value_to_name(fan_to_name, ac_get_fan()));
+    cJSON_AddStringToObject(state, "action", ac_get_power() ?
+        value_to_name(action_to_name, ac_get_mode()) : "off");
+
+    if ((payload = cJSON_PrintUnformatted(state)))
+    {
+        mqtt_publish(topic_get(TOPIC_STATE), (uint8_t *)payload,
+            strlen(payload), config_mqtt_qos_get(), config_mqtt_retained_get());
+    }
 
-    ESP_LOGI(TAG, "AC fan changed: %s", payload);
-    snprintf(topic, MAX_TOPIC_LEN, "%s/Fan", device_name_get());
-    mqtt_publish(topic, (uint8_t *)payload, strlen(payload),
-        config_mqtt_qos_get(), config_mqtt_retained_get());
+    cJSON_free(payload);
+    cJSON_Delete(state);
+}
+
+static void ac_on_state_changed(uint32_t changed, int64_t origin)
+{
+    ESP_LOGI(TAG, "AC state changed: 0x%" PRIx32, changed);
+
+    if (changed & AC_CHANGED_POWER)
+        publish_power();
+    if (changed & AC_CHANGED_TEMPERATURE)
+        publish_temperature();
+    if (changed & AC_CHANGED_FAN)
+        publish_fan();
+    /* Action and Mode depend on both the power and the mode */
+    if (changed & (AC_CHANGED_POWER | AC_CHANGED_MODE))
+        publish_ac();
+    if (config_mqtt_json_state_get())
+        publish_state();
+    /* The model and the supported modes and fans are now known */
+    if (changed & AC_CHANGED_MODEL)
+        discovery_publish();
+
+    /* While disconnected, the state is only queued for later */
+    if (mqtt_is_connected())
+        latency_record(LATENCY_STAGE_PUBLISH, origin);
 }
 
 static void ac_on_mqtt_power(bool on)
@@ -430,7 +760,7 @@ static void ac_on_mqtt_power(bool on)
         return;
     }
 
-    ac_ir_send();
+    ac_ir_send_schedule();
 }
 
 static void ac_on_mqtt_temperature(int temperature)
@@ -441,21 +771,26 @@ static void ac_on_mqtt_temperature(int temperature)
         return;
     }
 
-    ac_ir_send();
+    ac_ir_send_schedule();
 }
 
 static void ac_on_mqtt_mode(ac_mode_t mode)
 {
+    int ret;
+
     /* If the mode was changed, we also need to power on */
+    ac_transaction_begin();
     ac_set_power(1);
+    ret = ac_set_mode(mode);
+    ac_transaction_end();
 
-    if (ac_set_mode(mode))
+    if (ret)
     {
         ESP_LOGE(TAG, "Failed setting AC mode %d", mode);
         return;
     }
 
-    ac_ir_send();
+    ac_ir_send_schedule();
 }
 
 static void ac_on_mqtt_fan(ac_fan_t fan)
@@ -466,7 +801,36 @@ static void ac_on_mqtt_fan(ac_fan_t fan)
         return;
     }
 
-    ac_ir_send();
+    ac_ir_send_schedule();
+}
+
+static void ac_on_mqtt_state(int power, int temperature, int mode, int fan)
+{
+    int applied = 0, failed = 0;
+
+    /* Apply all fields at once so only a single IR frame is sent */
+    ac_transaction_begin();
+    /* If the mode was changed, we also need to power on */
+    if (power == -1 && mode != -1)
+        power = 1;
+    if (power != -1)
+        ac_set_power(power) ? failed++ : applied++;
+    if (temperature != -1)
+        ac_set_temperature(temperature) ? failed++ : applied++;
+    if (mode != -1)
+        ac_set_mode(mode) ? failed++ : applied++;
+    if (fan != -1)
+        ac_set_fan(fan) ? failed++ : applied++;
+    ac_transaction_end();
+
+    if (failed)
+        ESP_LOGE(TAG, "Failed setting %d of the AC state fields", failed);
+
+    /* An empty, or entirely invalid, state has nothing to send */
+    if (!applied)
+        return;
+
+    ac_ir_send_schedule();
 }
 
 /* AC MITM task and event callbacks */
@@ -480,14 +844,15 @@ typedef enum {
     EVENT_TYPE_MQTT_DISCONNECTED = 6,
     EVENT_TYPE_POWER_DETECTOR_CHANGED = 7,
     EVENT_TYPE_IR_RECV = 8,
-    EVENT_TYPE_AC_POWER_CHANGED = 9,
-    EVENT_TYPE_AC_TEMPERATURE_CHANGED = 10,
-    EVENT_TYPE_AC_MODE_CHANGED = 11,
-    EVENT_TYPE_AC_FAN_CHANGED = 12,
-    EVENT_TYPE_AC_MQTT_POWER = 13,
-    EVENT_TYPE_AC_MQTT_TEMPERATURE = 14,
-    EVENT_TYPE_AC_MQTT_MODE = 15,
-    EVENT_TYPE_AC_MQTT_FAN = 16,
+    EVENT_TYPE_AC_MQTT_POWER = 10,
+    EVENT_TYPE_AC_MQTT_TEMPERATURE = 11,
+    EVENT_TYPE_AC_MQTT_MODE = 12,
+    EVENT_TYPE_AC_MQTT_FAN = 13,
+    EVENT_TYPE_AC_MQTT_STATE = 14,
+    EVENT_TYPE_AC_IR_SEND = 15,
+    EVENT_TYPE_CAPTURE_MQTT = 16,
+    EVENT_TYPE_IR_FRAME = 17,
+    EVENT_TYPE_RESTART = 18,
 } event_type_t;
 
 typedef struct {
@@ -510,7 +875,13 @@ typedef struct {
         struct {
             rmt_symbol_word_t *symbols;
             size_t len;
+            int64_t time;
         } ir_recv;
+        struct {
+            ac_frame_t frame;
+            int64_t time;
+            bool sent;
+        } ir_frame;
         struct {
             bool on;
         } ac_power;
@@ -523,10 +894,21 @@ typedef struct {
         struct {
             ac_fan_t fan;
         } ac_fan;
+        struct {
+            int power;
+            int temperature;
+            int mode;
+            int fan;
+        } ac_state_set;
     };
 } event_t;
 
 static QueueHandle_t event_queue;
+static uint8_t ir_passthrough = 0;
+/* IR_RECV events not yet handled by the AC task */
+static atomic_uint ir_recv_pending = 0;
+static atomic_uint event_queue_high_water_mark = 0;
+static atomic_uint event_queue_dropped = 0;
 
 static void ac_mitm_handle_event(event_t *event)
 {
@@ -561,20 +943,14 @@ static void ac_mitm_handle_event(event_t *event)
             event->power_detector_changed.level);
         break;
     case EVENT_TYPE_IR_RECV:
-        ir_on_recv(event->ir_recv.symbols, event->ir_recv.len);
-        free(event->ir_recv.symbols);
-        break;
-    case EVENT_TYPE_AC_POWER_CHANGED:
-        ac_on_power_changed(event->ac_power.on);
-        break;
-    case EVENT_TYPE_AC_TEMPERATURE_CHANGED:
-        ac_on_temperature_changed(event->ac_temperature.temperature);
-        break;
-    case EVENT_TYPE_AC_MODE_CHANGED:
-        ac_on_mode_changed(event->ac_mode.mode);
+        ir_on_recv(event->ir_recv.symbols, event->ir_recv.len,
+            event->ir_recv.time);
+        ir_recv_release(event->ir_recv.symbols);
+        atomic_fetch_sub(&ir_recv_pending, 1);
         break;
-    case EVENT_TYPE_AC_FAN_CHANGED:
-        ac_on_fan_changed(event->ac_fan.fan);
+    case EVENT_TYPE_IR_FRAME:
+        ir_on_frame(&event->ir_frame.frame, event->ir_frame.time,
+            event->ir_frame.sent);
         break;
     case EVENT_TYPE_AC_MQTT_POWER:
         ac_on_mqtt_power(event->ac_power.on);
@@ -586,45 +962,143 @@ static void ac_mitm_handle_event(event_t *event)
         ac_on_mqtt_mode(event->ac_mode.mode);
         break;
     case EVENT_TYPE_AC_MQTT_FAN:
-        ac_on_mqtt_fan(event->ac_power.on);
+        ac_on_mqtt_fan(event->ac_fan.fan);
+        break;
+    case EVENT_TYPE_AC_MQTT_STATE:
+        ac_on_mqtt_state(event->ac_state_set.power,
+            event->ac_state_set.temperature, event->ac_state_set.mode,
+            event->ac_state_set.fan);
+        break;
+    case EVENT_TYPE_AC_IR_SEND:
+        ac_ir_send_scheduled();
+        break;
+    case EVENT_TYPE_RESTART:
+        reset();
+        break;
+    case EVENT_TYPE_CAPTURE_MQTT:
+        capture_on_mqtt(event->mqtt_message.topic,
+            event->mqtt_message.payload, event->mqtt_message.len,
+            event->mqtt_message.ctx);
+        free(event->mqtt_message.topic);
+        free(event->mqtt_message.payload);
         break;
     }
-
-    free(event);
 }
 
 static void ac_mitm_task(void *pvParameter)
 {
-    event_t *event;
+    event_t event;
 
     while (1)
     {
         if (xQueueReceive(event_queue, &event, portMAX_DELAY) != pdTRUE)
             continue;
 
-        ac_mitm_handle_event(event);
+        ac_mitm_handle_event(&event);
     }
 
     vTaskDelete(NULL);
 }
 
-static void heartbeat_timer_cb(TimerHandle_t xTimer)
+/* How long the sender of an event waits for a free slot */
+static TickType_t event_queue_timeout(event_type_t type)
+{
+    switch (type)
+    {
+    /* Connectivity, OTA, power detector and restart events change what the
+     * task does next, losing one leaves it out of sync or ignores a request.
+     * The remote's frames are all the AC gets, and are bounded by the IR
+     * receive buffers */
+    case EVENT_TYPE_NETWORK_CONNECTED:
+    case EVENT_TYPE_NETWORK_DISCONNECTED:
+    case EVENT_TYPE_OTA_COMPLETED:
+    case EVENT_TYPE_MQTT_CONNECTED:
+    case EVENT_TYPE_MQTT_DISCONNECTED:
+    case EVENT_TYPE_POWER_DETECTOR_CHANGED:
+    case EVENT_TYPE_RESTART:
+    case EVENT_TYPE_IR_RECV:
+    case EVENT_TYPE_IR_FRAME:
+        return portMAX_DELAY;
+    /* Commands and requests received over MQTT */
+    case EVENT_TYPE_OTA_MQTT:
+    case EVENT_TYPE_CAPTURE_MQTT:
+    case EVENT_TYPE_AC_MQTT_POWER:
+    case EVENT_TYPE_AC_MQTT_TEMPERATURE:
+    case EVENT_TYPE_AC_MQTT_MODE:
+    case EVENT_TYPE_AC_MQTT_FAN:
+    case EVENT_TYPE_AC_MQTT_STATE:
+        return pdMS_TO_TICKS(EVENT_QUEUE_MQTT_TIMEOUT_MS);
+    /* Timers, which retry or are harmless to miss */
+    default:
+        return 0;
+    }
+}
+
+/* Events that don't wait are dropped once only the reserved slots are left */
+static int event_queue_send(event_t *event)
 {
-    event_t *event = malloc(sizeof(*event));
+    TickType_t timeout = event_queue_timeout(event->type);
+    unsigned int depth, high_water_mark;
 
-    event->type = EVENT_TYPE_HEARTBEAT_TIMER;
+    if ((!timeout &&
+        uxQueueSpacesAvailable(event_queue) <= EVENT_QUEUE_RESERVED_SLOTS) ||
+        xQueueSend(event_queue, event, timeout) != pdTRUE)
+    {
+        ESP_LOGW(TAG, "Event queue is full, dropping event %d", event->type);
+        atomic_fetch_add(&event_queue_dropped, 1);
+        return -1;
+    }
 
+    depth = uxQueueMessagesWaiting(event_queue);
+    high_water_mark = atomic_load(&event_queue_high_water_mark);
+    while (depth > high_water_mark &&
+        !atomic_compare_exchange_weak(&event_queue_high_water_mark,
+        &high_water_mark, depth));
+
+    return 0;
+}
+
+static void event_queue_stats_get(unsigned int *depth,
+    unsigned int *high_water_mark, unsigned int *dropped)
+{
+    *depth = uxQueueMessagesWaiting(event_queue);
+    *high_water_mark = atomic_load(&event_queue_high_water_mark);
+    *dropped = atomic_load(&event_queue_dropped);
+}
+
+static void heartbeat_timer_cb(TimerHandle_t xTimer)
+{
+    event_t event = { .type = EVENT_TYPE_HEARTBEAT_TIMER };
+
+    /* A missed heartbeat is harmless */
     ESP_LOGD(TAG, "Queuing event HEARTBEAT_TIMER");
-    xQueueSend(event_queue, &event, portMAX_DELAY);
+    event_queue_send(&event);
+}
+
+static void ir_send_timer_cb(TimerHandle_t xTimer)
+{
+    event_t event = { .type = EVENT_TYPE_AC_IR_SEND };
+
+    ESP_LOGD(TAG, "Queuing event AC_IR_SEND");
+    /* Retry later if the queue is full */
+    if (event_queue_send(&event))
+        xTimerReset(xTimer, 0);
 }
 
 static int start_ac_mitm_task(void)
 {
     TimerHandle_t hb_timer;
 
-    if (!(event_queue = xQueueCreate(10, sizeof(event_t *))))
+    if (!(event_queue = xQueueCreate(EVENT_QUEUE_LENGTH, sizeof(event_t))))
         return -1;
 
+    if (!(ir_send_timer = xTimerCreate("ir_send",
+        pdMS_TO_TICKS(config_ac_send_delay_get() ? : 1), pdFALSE, NULL,
+        ir_send_timer_cb)))
+    {
+        return -1;
+    }
+
     if (xTaskCreatePinnedToCore(ac_mitm_task, "ac_mitm_task", 4096,
         NULL, 5, NULL, 1) != pdPASS)
     {
@@ -641,38 +1115,40 @@ static int start_ac_mitm_task(void)
 static void _mqtt_on_message(event_type_t type, const char *topic,
     const uint8_t *payload, size_t len, void *ctx)
 {
-    event_t *event = malloc(sizeof(*event));
+    event_t event = { .type = type };
 
-    event->type = type;
-    event->mqtt_message.topic = strdup(topic);
-    event->mqtt_message.payload = malloc(len);
-    memcpy(event->mqtt_message.payload, payload, len);
-    event->mqtt_message.len = len;
-    event->mqtt_message.ctx = ctx;
+    event.mqtt_message.topic = strdup(topic);
+    event.mqtt_message.payload = malloc(len);
+    if (!event.mqtt_message.topic || !event.mqtt_message.payload)
+        goto Drop;
+    memcpy(event.mqtt_message.payload, payload, len);
+    event.mqtt_message.len = len;
+    event.mqtt_message.ctx = ctx;
 
     ESP_LOGD(TAG, "Queuing event MQTT message %d (%s, %p, %zd, %p)", type,
         topic, payload, len, ctx);
-    xQueueSend(event_queue, &event, portMAX_DELAY);
+    if (!event_queue_send(&event))
+        return;
+
+Drop:
+    free(event.mqtt_message.topic);
+    free(event.mqtt_message.payload);
 }
 
 static void _network_on_connected(void)
 {
-    event_t *event = malloc(sizeof(*event));
-
-    event->type = EVENT_TYPE_NETWORK_CONNECTED;
+    event_t event = { .type = EVENT_TYPE_NETWORK_CONNECTED };
 
     ESP_LOGD(TAG, "Queuing event NETWORK_CONNECTED");
-    xQueueSend(event_queue, &event, portMAX_DELAY);
+    event_queue_send(&event);
 }
 
 static void _network_on_disconnected(void)
 {
-    event_t *event = malloc(sizeof(*event));
-
-    event->type = EVENT_TYPE_NETWORK_DISCONNECTED;
+    event_t event = { .type = EVENT_TYPE_NETWORK_DISCONNECTED };
 
     ESP_LOGD(TAG, "Queuing event NETWORK_DISCONNECTED");
-    xQueueSend(event_queue, &event, portMAX_DELAY);
+    event_queue_send(&event);
 }
 
 static void _ota_on_mqtt(const char *topic, const uint8_t *payload, size_t len,
@@ -681,170 +1157,220 @@ static void _ota_on_mqtt(const char *topic, const uint8_t *payload, size_t len,
     _mqtt_on_message(EVENT_TYPE_OTA_MQTT, topic, payload, len, ctx);
 }
 
+static void _capture_on_mqtt(const char *topic, const uint8_t *payload,
+    size_t len, void *ctx)
+{
+    _mqtt_on_message(EVENT_TYPE_CAPTURE_MQTT, topic, payload, len, ctx);
+}
+
 static void _ota_on_completed(ota_type_t type, ota_err_t err)
 {
-    event_t *event = malloc(sizeof(*event));
+    event_t event = { .type = EVENT_TYPE_OTA_COMPLETED };
 
-    event->type = EVENT_TYPE_OTA_COMPLETED;
-    event->ota_completed.type = type;
-    event->ota_completed.err = err;
+    event.ota_completed.type = type;
+    event.ota_completed.err = err;
 
-    ESP_LOGD(TAG, "Queuing event HEARTBEAT_TIMER (%d, %d)", type, err);
-    xQueueSend(event_queue, &event, portMAX_DELAY);
+    ESP_LOGD(TAG, "Queuing event OTA_COMPLETED (%d, %d)", type, err);
+    event_queue_send(&event);
 }
 
-static void _mqtt_on_connected(void)
+static void _httpd_on_restart(void)
 {
-    event_t *event = malloc(sizeof(*event));
+    event_t event = { .type = EVENT_TYPE_RESTART };
 
-    event->type = EVENT_TYPE_MQTT_CONNECTED;
+    ESP_LOGD(TAG, "Queuing event RESTART");
+    event_queue_send(&event);
+}
+
+static void _mqtt_on_connected(void)
+{
+    event_t event = { .type = EVENT_TYPE_MQTT_CONNECTED };
 
     ESP_LOGD(TAG, "Queuing event MQTT_CONNECTED");
-    xQueueSend(event_queue, &event, portMAX_DELAY);
+    event_queue_send(&event);
 }
 
 static void _mqtt_on_disconnected(void)
 {
-    event_t *event = malloc(sizeof(*event));
-
-    event->type = EVENT_TYPE_MQTT_DISCONNECTED;
+    event_t event = { .type = EVENT_TYPE_MQTT_DISCONNECTED };
 
     ESP_LOGD(TAG, "Queuing event MQTT_DISCONNECTED");
-    xQueueSend(event_queue, &event, portMAX_DELAY);
+    event_queue_send(&event);
 }
 
 static void _power_detector_changed(int pin, int level)
 {
-    event_t *event = malloc(sizeof(*event));
+    event_t event = { .type = EVENT_TYPE_POWER_DETECTOR_CHANGED };
 
-    event->type = EVENT_TYPE_POWER_DETECTOR_CHANGED;
-    event->power_detector_changed.pin = pin;
-    event->power_detector_changed.level = level;
+    event.power_detector_changed.pin = pin;
+    event.power_detector_changed.level = level;
 
     ESP_LOGD(TAG, "Queuing event POWER_DETECTOR_CHANGED");
-    xQueueSend(event_queue, &event, portMAX_DELAY);
+    event_queue_send(&event);
 }
 
-static void _ir_on_recv(rmt_symbol_word_t *symbols, size_t len)
+/* Runs in the IR task, the frame goes out before anything else happens */
+static void ir_passthrough_recv(rmt_symbol_word_t *symbols, size_t len)
 {
-    event_t *event = malloc(sizeof(*event));
-
-    event->type = EVENT_TYPE_IR_RECV;
-    event->ir_recv.symbols = malloc(sizeof(*symbols) * len);
-    memcpy(event->ir_recv.symbols, symbols, sizeof(*symbols) * len); 
-    event->ir_recv.len = len;
-
-    ESP_LOGD(TAG, "Queuing event IR_RECV");
-    xQueueSend(event_queue, &event, portMAX_DELAY);
-}
+    event_t event = {
+        .type = EVENT_TYPE_IR_FRAME,
+        .ir_frame.time = ir_recv_time_get(),
+    };
+    int ret = ac_ir_decode(symbols, len, event.ir_frame.time,
+        &event.ir_frame.frame);
 
-static void _ac_on_power_changed(bool on)
-{
-    event_t *event = malloc(sizeof(*event));
+    event.ir_frame.sent = !ret &&
+        !ac_ir_passthrough(&event.ir_frame.frame, event.ir_frame.time);
 
-    event->type = EVENT_TYPE_AC_POWER_CHANGED;
-    event->ac_power.on = on;
+    capture_add(symbols, len, ret < 0 ? CAPTURE_OUTCOME_FAILED :
+        ret ? CAPTURE_OUTCOME_DUPLICATE : CAPTURE_OUTCOME_DECODED);
+    ir_recv_release(symbols);
+    if (ret)
+        return;
 
-    ESP_LOGD(TAG, "Queuing event AC_POWER_CHANGED");
-    xQueueSend(event_queue, &event, portMAX_DELAY);
+    ESP_LOGD(TAG, "Queuing event IR_FRAME");
+    event_queue_send(&event);
 }
 
-static void _ac_on_temperature_changed(int temperature)
+static void _ir_on_recv(rmt_symbol_word_t *symbols, size_t len)
 {
-    event_t *event = malloc(sizeof(*event));
-
-    event->type = EVENT_TYPE_AC_TEMPERATURE_CHANGED;
-    event->ac_temperature.temperature = temperature;
-
-    ESP_LOGD(TAG, "Queuing event AC_TEMPERATURE_CHANGED");
-    xQueueSend(event_queue, &event, portMAX_DELAY);
-}
+    event_t event = { .type = EVENT_TYPE_IR_RECV };
 
-static void _ac_on_mode_changed(ac_mode_t mode)
-{
-    event_t *event = malloc(sizeof(*event));
+    /* Frames are decoded in the AC task until the protocol is learned, and
+     * the IR task takes over only once all of those were handled, so the
+     * decoder and the duplicate and rejection bookkeeping are never shared */
+    if (ir_passthrough && !atomic_load(&ir_recv_pending) && ac_get_model())
+    {
+        ir_passthrough_recv(symbols, len);
+        return;
+    }
 
-    event->type = EVENT_TYPE_AC_MODE_CHANGED;
-    event->ac_mode.mode = mode;
+    event.ir_recv.symbols = symbols;
+    event.ir_recv.len = len;
+    event.ir_recv.time = ir_recv_time_get();
 
-    ESP_LOGD(TAG, "Queuing event AC_MODE_CHANGED");
-    xQueueSend(event_queue, &event, portMAX_DELAY);
+    ESP_LOGD(TAG, "Queuing event IR_RECV");
+    atomic_fetch_add(&ir_recv_pending, 1);
+    if (event_queue_send(&event))
+    {
+        atomic_fetch_sub(&ir_recv_pending, 1);
+        ir_recv_release(symbols);
+    }
 }
 
-static void _ac_on_fan_changed(ac_fan_t fan)
+/* The AC state only changes in the AC task, so it's published right away
+ * rather than queued behind, and possibly dropped with, other events */
+static void _ac_on_state_changed(uint32_t changed)
 {
-    event_t *event = malloc(sizeof(*event));
-
-    event->type = EVENT_TYPE_AC_FAN_CHANGED;
-    event->ac_fan.fan = fan;
-
-    ESP_LOGD(TAG, "Queuing event AC_FAN_CHANGED");
-    xQueueSend(event_queue, &event, portMAX_DELAY);
+    ac_on_state_changed(changed, state_origin);
 }
 
 static void _ac_on_mqtt_power(const char *topic, const uint8_t *payload,
     size_t len, void *ctx)
 {
-    event_t *event = malloc(sizeof(*event));
+    event_t event = { .type = EVENT_TYPE_AC_MQTT_POWER };
 
-    event->type = EVENT_TYPE_AC_MQTT_POWER;
-    event->ac_power.on = len == 2 && !strncmp((char *)payload, "on", len);
+    event.ac_power.on = len == 2 && !strncmp((char *)payload, "on", len);
 
     ESP_LOGD(TAG, "Queuing event AC_MQTT_POWER");
-    xQueueSend(event_queue, &event, portMAX_DELAY);
+    event_queue_send(&event);
 }
 
 static void _ac_on_mqtt_temperature(const char *topic, const uint8_t *payload,
     size_t len, void *ctx)
 {
-    event_t *event = malloc(sizeof(*event));
+    event_t event = { .type = EVENT_TYPE_AC_MQTT_TEMPERATURE };
     char *temperature = strndup((char *)payload, len);
 
-    event->type = EVENT_TYPE_AC_MQTT_TEMPERATURE;
-    event->ac_temperature.temperature = atoi(temperature);
+    if (!temperature)
+        return;
+
+    event.ac_temperature.temperature = atoi(temperature);
 
     ESP_LOGD(TAG, "Queuing event AC_MQTT_TEMPERATURE");
-    xQueueSend(event_queue, &event, portMAX_DELAY);
+    event_queue_send(&event);
     free(temperature);
 }
 
 static void _ac_on_mqtt_mode(const char *topic, const uint8_t *payload,
     size_t len, void *ctx)
 {
-    event_t *event = malloc(sizeof(*event));
+    event_t event;
     char *mode = strndup((char *)payload, len);
 
+    if (!mode)
+        return;
+
     if (!strcmp(mode, "off"))
     {
-        event->type = EVENT_TYPE_AC_MQTT_POWER;
-        event->ac_power.on = 0;
+        event.type = EVENT_TYPE_AC_MQTT_POWER;
+        event.ac_power.on = 0;
         ESP_LOGD(TAG, "Queuing event AC_MQTT_POWER");
     }
     else
     {
-        event->type = EVENT_TYPE_AC_MQTT_MODE;
-        event->ac_mode.mode = name_to_value(mode_to_name, mode);
+        event.type = EVENT_TYPE_AC_MQTT_MODE;
+        event.ac_mode.mode = name_to_value(mode_to_name, mode);
         ESP_LOGD(TAG, "Queuing event AC_MQTT_MODE");
     }
 
-    xQueueSend(event_queue, &event, portMAX_DELAY);
+    event_queue_send(&event);
     free(mode);
 }
 
 static void _ac_on_mqtt_fan(const char *topic, const uint8_t *payload,
     size_t len, void *ctx)
 {
-    event_t *event = malloc(sizeof(*event));
+    event_t event = { .type = EVENT_TYPE_AC_MQTT_FAN };
     char *fan = strndup((char *)payload, len);
 
-    event->type = EVENT_TYPE_AC_MQTT_FAN;
-    event->ac_fan.fan = name_to_value(fan_to_name, fan);
+    if (!fan)
+        return;
+
+    event.ac_fan.fan = name_to_value(fan_to_name, fan);
 
     ESP_LOGD(TAG, "Queuing event AC_MQTT_FAN");
-    xQueueSend(event_queue, &event, portMAX_DELAY);
+    event_queue_send(&event);
     free(fan);
 }
 
+static void _ac_on_mqtt_state(const char *topic, const uint8_t *payload,
+    size_t len, void *ctx)
+{
+    event_t event = { .type = EVENT_TYPE_AC_MQTT_STATE };
+    cJSON *state = cJSON_ParseWithLength((char *)payload, len);
+    cJSON *power = cJSON_GetObjectItem(state, "power");
+    cJSON *temperature = cJSON_GetObjectItem(state, "temperature");
+    cJSON *mode = cJSON_GetObjectItem(state, "mode");
+    cJSON *fan = cJSON_GetObjectItem(state, "fan");
+
+    if (!cJSON_IsObject(state))
+    {
+        ESP_LOGE(TAG, "Invalid AC state: %.*s", (int)len, (char *)payload);
+        cJSON_Delete(state);
+        return;
+    }
+
+    event.ac_state_set.power = cJSON_IsString(power) ?
+        !strcmp(power->valuestring, "on") : -1;
+    event.ac_state_set.temperature = cJSON_IsNumber(temperature) ?
+        temperature->valueint : -1;
+    event.ac_state_set.mode = -1;
+    event.ac_state_set.fan = cJSON_IsString(fan) ?
+        name_to_value(fan_to_name, fan->valuestring) : -1;
+
+    /* Keep the same semantics as the Mode topic, where "off" is a mode */
+    if (cJSON_IsString(mode) && !strcmp(mode->valuestring, "off"))
+        event.ac_state_set.power = 0;
+    else if (cJSON_IsString(mode))
+        event.ac_state_set.mode =
+            name_to_value(mode_to_name, mode->valuestring);
+
+    ESP_LOGD(TAG, "Queuing event AC_MQTT_STATE");
+    event_queue_send(&event);
+    cJSON_Delete(state);
+}
+
 void app_main()
 {
     int config_failed;
@@ -895,27 +1421,45 @@ void app_main()
     ESP_ERROR_CHECK(resolve_initialize());
 
     /* Init MQTT */
-    ESP_ERROR_CHECK(mqtt_initialize());
+    ESP_ERROR_CHECK(mqtt_initialize(config_mqtt_offline_queue_size_get(),
+        !strcmp(config_mqtt_offline_queue_overflow_get(), "drop_newest") ?
+        MQTT_OVERFLOW_DROP_NEWEST : MQTT_OVERFLOW_DROP_OLDEST,
+        config_mqtt_offline_queue_persistent_get()));
     mqtt_set_on_connected_cb(_mqtt_on_connected);
     mqtt_set_on_disconnected_cb(_mqtt_on_disconnected);
 
     /* Init web server */
     ESP_ERROR_CHECK(httpd_initialize());
     httpd_set_on_ota_completed_cb(_ota_on_completed);
+    httpd_set_on_restart_cb(_httpd_on_restart);
+
+    /* Init IR capture buffer */
+    capture_initialize();
+
+    /* Init IR decoders and AC */
+    ir_decoder_initialize();
+    ac_initialize(config_ac_protocol_get());
+    ac_set_on_state_changed_cb(_ac_on_state_changed);
 
-    /* Init AC */
-    ac_initialize("airwell");
-    ac_set_on_power_changed_cb(_ac_on_power_changed);
-    ac_set_on_temperature_changed_cb(_ac_on_temperature_changed);
-    ac_set_on_mode_changed_cb(_ac_on_mode_changed);
-    ac_set_on_fan_changed_cb(_ac_on_fan_changed);
+    /* Init MQTT topics, once all IR protocols were registered */
+    ESP_ERROR_CHECK(topics_initialize(config_mqtt_topics_prefix_get(),
+        device_name_get()));
+
+    /* Init Home Assistant discovery */
+    if (config_mqtt_discovery_enabled_get())
+    {
+        ESP_ERROR_CHECK(discovery_initialize(
+            config_mqtt_discovery_prefix_get(), device_name_get()));
+    }
 
     /* Init power detector */
     power_detector_initialize(7);
     power_detector_set_on_change(_power_detector_changed);
 
     /* Init IR */
-    ir_initialize(9, 8);
+    ir_passthrough = config_ac_passthrough_get();
+    ir_initialize(9, 8,
+        ir_tx_encoder_atoencoder(config_ac_ir_tx_encoder_get()));
     ir_set_on_recv_cb(_ir_on_recv);
 
     /* Start AC MITM task */
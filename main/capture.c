@@ -0,0 +1,121 @@
+#include "capture.h"
+#include <driver/rmt_types.h>
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "CAPTURE";
+
+/* An Airwell frame, with its repeats, is 106 symbols */
+#define CAPTURE_ENTRIES 8
+#define CAPTURE_MAX_SYMBOLS 128
+
+/* Types */
+typedef struct {
+    capture_header_t header;
+    uint32_t symbols[CAPTURE_MAX_SYMBOLS];
+} capture_entry_t;
+
+/* Internal state */
+static capture_entry_t *captures = NULL;
+static unsigned int captures_next = 0;
+static unsigned int captures_count = 0;
+static SemaphoreHandle_t captures_lock = NULL;
+
+void capture_add(const rmt_symbol_word_t *symbols, size_t len,
+    capture_outcome_t outcome)
+{
+    capture_entry_t *entry;
+    size_t i;
+
+    if (!captures)
+        return;
+
+    xSemaphoreTake(captures_lock, portMAX_DELAY);
+    entry = &captures[captures_next];
+    entry->header.timestamp = esp_timer_get_time() / 1000;
+    entry->header.outcome = outcome;
+    entry->header.flags = 0;
+    if (len > CAPTURE_MAX_SYMBOLS)
+    {
+        entry->header.flags |= CAPTURE_FLAG_TRUNCATED;
+        len = CAPTURE_MAX_SYMBOLS;
+    }
+    entry->header.len = len;
+    for (i = 0; i < len; i++)
+        entry->symbols[i] = symbols[i].val;
+
+    captures_next = (captures_next + 1) % CAPTURE_ENTRIES;
+    if (captures_count < CAPTURE_ENTRIES)
+        captures_count++;
+    xSemaphoreGive(captures_lock);
+}
+
+uint8_t *capture_export(size_t *len)
+{
+    uint8_t *blob, *p;
+    unsigned int i, index;
+
+    if (!captures)
+        return NULL;
+
+    xSemaphoreTake(captures_lock, portMAX_DELAY);
+    *len = CAPTURE_FILE_HEADER_SIZE;
+    for (i = 0; i < captures_count; i++)
+    {
+        *len += sizeof(capture_header_t) +
+            captures[i].header.len * sizeof(uint32_t);
+    }
+
+    if (!(p = blob = malloc(*len)))
+    {
+        xSemaphoreGive(captures_lock);
+        return NULL;
+    }
+
+    memcpy(p, CAPTURE_MAGIC, 4);
+    p[4] = CAPTURE_VERSION;
+    p[5] = captures_count;
+    p[6] = p[7] = 0;
+    p += CAPTURE_FILE_HEADER_SIZE;
+
+    index = (captures_next + CAPTURE_ENTRIES - captures_count) %
+        CAPTURE_ENTRIES;
+    for (i = 0; i < captures_count; i++)
+    {
+        capture_entry_t *entry = &captures[index];
+        size_t symbols_len = entry->header.len * sizeof(uint32_t);
+
+        memcpy(p, &entry->header, sizeof(entry->header));
+        p += sizeof(entry->header);
+        memcpy(p, entry->symbols, symbols_len);
+        p += symbols_len;
+        index = (index + 1) % CAPTURE_ENTRIES;
+    }
+    xSemaphoreGive(captures_lock);
+
+    return blob;
+}
+
+int capture_initialize(void)
+{
+    /* Prefer PSRAM, when available, the captures are never on a hot path */
+    captures = heap_caps_calloc(CAPTURE_ENTRIES, sizeof(*captures),
+        MALLOC_CAP_SPIRAM);
+    if (!captures)
+        captures = calloc(CAPTURE_ENTRIES, sizeof(*captures));
+
+    if (!captures || !(captures_lock = xSemaphoreCreateMutex()))
+    {
+        ESP_LOGE(TAG, "Failed allocating IR capture buffer");
+        free(captures);
+        captures = NULL;
+        return -1;
+    }
+
+    return 0;
+}
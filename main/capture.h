@@ -0,0 +1,38 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <driver/rmt_types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Types */
+typedef enum {
+    CAPTURE_OUTCOME_DECODED,
+    CAPTURE_OUTCOME_FAILED,
+    CAPTURE_OUTCOME_DUPLICATE,
+} capture_outcome_t;
+
+/* Exported blob, all fields are little endian:
+ *   Header: "IRCP", u8 version, u8 number of captures, u16 reserved
+ *   Per capture, oldest first: capture_header_t, raw RMT symbol words */
+#define CAPTURE_MAGIC "IRCP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_FILE_HEADER_SIZE 8
+#define CAPTURE_FLAG_TRUNCATED (1 << 0)
+
+typedef struct {
+    uint32_t timestamp; /* mS since boot */
+    uint16_t len;
+    uint8_t outcome;
+    uint8_t flags;
+} __attribute__((packed)) capture_header_t;
+
+void capture_add(const rmt_symbol_word_t *symbols, size_t len,
+    capture_outcome_t outcome);
+
+/* Returns a malloc()ed blob of the current captures, or NULL */
+uint8_t *capture_export(size_t *len);
+
+int capture_initialize(void);
+
+#endif
@@ -3,6 +3,9 @@
 #include <esp_log.h>
 #include <esp_partition.h>
 #include <esp_spiffs.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/timers.h>
 #include <nvs.h>
 #include <cJSON.h>
 #include <fcntl.h>
@@ -24,11 +27,21 @@ static const char *config_file_name = "/spiffs/config.json";
 static const char *nvs_namespace = "config";
 static const char *nvs_active_partition = "active_part";
 static const char *nvs_ac_state = "ac_state";
+static const char *nvs_ac_protocol = "ac_protocol";
+static const uint32_t AC_STATE_COMMIT_DELAY_MS = 5000;
+static const uint32_t AC_STATE_COMMIT_MAX_DELAY_MS = 30000;
 static cJSON *config;
 
 /* Internal variables */
 static char config_version[65];
 static nvs_handle nvs;
+static portMUX_TYPE ac_state_lock = portMUX_INITIALIZER_UNLOCKED;
+/* Serializes flushes, from the timer task and from the AC task */
+static SemaphoreHandle_t ac_state_flush_lock = NULL;
+static TimerHandle_t ac_state_timer = NULL;
+static uint64_t ac_state_pending, ac_state_saved;
+static TickType_t ac_state_pending_since;
+static uint32_t ac_state_commits = 0;
 
 /* Common utilities */
 static char *read_file(const char *path)
@@ -203,6 +216,48 @@ uint8_t config_mqtt_retained_get(void)
     return cJSON_IsTrue(retain);
 }
 
+uint8_t config_mqtt_json_state_get(void)
+{
+    cJSON *mqtt = cJSON_GetObjectItem(config, "mqtt");
+    cJSON *publish = cJSON_GetObjectItem(mqtt, "publish");
+    cJSON *json_state = cJSON_GetObjectItem(publish, "json_state");
+
+    return cJSON_IsTrue(json_state);
+}
+
+uint16_t config_mqtt_offline_queue_size_get(void)
+{
+    cJSON *mqtt = cJSON_GetObjectItem(config, "mqtt");
+    cJSON *offline_queue = cJSON_GetObjectItem(mqtt, "offline_queue");
+    cJSON *size = cJSON_GetObjectItem(offline_queue, "size");
+
+    if (cJSON_IsNumber(size))
+        return size->valuedouble;
+
+    return 32;
+}
+
+uint8_t config_mqtt_offline_queue_persistent_get(void)
+{
+    cJSON *mqtt = cJSON_GetObjectItem(config, "mqtt");
+    cJSON *offline_queue = cJSON_GetObjectItem(mqtt, "offline_queue");
+    cJSON *persistent = cJSON_GetObjectItem(offline_queue, "persistent");
+
+    return cJSON_IsTrue(persistent);
+}
+
+const char *config_mqtt_offline_queue_overflow_get(void)
+{
+    cJSON *mqtt = cJSON_GetObjectItem(config, "mqtt");
+    cJSON *offline_queue = cJSON_GetObjectItem(mqtt, "offline_queue");
+    cJSON *overflow = cJSON_GetObjectItem(offline_queue, "overflow");
+
+    if (cJSON_IsString(overflow))
+        return overflow->valuestring;
+
+    return "drop_oldest";
+}
+
 const char *config_mqtt_topics_get(const char *param_name, const char *def)
 {
     cJSON *mqtt = cJSON_GetObjectItem(config, "mqtt");
@@ -215,6 +270,32 @@ const char *config_mqtt_topics_get(const char *param_name, const char *def)
     return def;
 }
 
+const char *config_mqtt_topics_prefix_get(void)
+{
+    return config_mqtt_topics_get("prefix", NULL);
+}
+
+uint8_t config_mqtt_discovery_enabled_get(void)
+{
+    cJSON *mqtt = cJSON_GetObjectItem(config, "mqtt");
+    cJSON *discovery = cJSON_GetObjectItem(mqtt, "discovery");
+    cJSON *enabled = cJSON_GetObjectItem(discovery, "enabled");
+
+    return !cJSON_IsFalse(enabled);
+}
+
+const char *config_mqtt_discovery_prefix_get(void)
+{
+    cJSON *mqtt = cJSON_GetObjectItem(config, "mqtt");
+    cJSON *discovery = cJSON_GetObjectItem(mqtt, "discovery");
+    cJSON *prefix = cJSON_GetObjectItem(discovery, "prefix");
+
+    if (cJSON_IsString(prefix))
+        return prefix->valuestring;
+
+    return "homeassistant";
+}
+
 /* Network Configuration */
 config_network_type_t config_network_type_get(void)
 {
@@ -381,14 +462,129 @@ const char *config_time_timezone_get(void)
     return "UTC";
 }
 
+/* AC Configuration */
+const char *config_ac_protocol_get(void)
+{
+    cJSON *ac = cJSON_GetObjectItem(config, "ac");
+    cJSON *protocol = cJSON_GetObjectItem(ac, "protocol");
+
+    if (cJSON_IsString(protocol) && *protocol->valuestring)
+        return protocol->valuestring;
+
+    return "auto";
+}
+
+uint8_t config_ac_adaptive_timing_get(void)
+{
+    cJSON *ac = cJSON_GetObjectItem(config, "ac");
+    cJSON *adaptive_timing = cJSON_GetObjectItem(ac, "adaptive_timing");
+
+    return cJSON_IsTrue(adaptive_timing);
+}
+
+uint8_t config_ac_passthrough_get(void)
+{
+    cJSON *ac = cJSON_GetObjectItem(config, "ac");
+    cJSON *passthrough = cJSON_GetObjectItem(ac, "passthrough");
+
+    return cJSON_IsTrue(passthrough);
+}
+
+uint16_t config_ac_send_delay_get(void)
+{
+    cJSON *ac = cJSON_GetObjectItem(config, "ac");
+    cJSON *send_delay = cJSON_GetObjectItem(ac, "send_delay_ms");
+
+    if (cJSON_IsNumber(send_delay))
+        return send_delay->valuedouble;
+
+    return 250;
+}
+
+const char *config_ac_ir_tx_encoder_get(void)
+{
+    cJSON *ac = cJSON_GetObjectItem(config, "ac");
+    cJSON *ir_tx = cJSON_GetObjectItem(ac, "ir_tx");
+    cJSON *encoder = cJSON_GetObjectItem(ir_tx, "encoder");
+
+    if (cJSON_IsString(encoder))
+        return encoder->valuestring;
+
+    return "streaming";
+}
+
 /* AC Persistent settings */
-int config_ac_persistent_save(uint64_t data)
+int config_ac_persistent_flush(void)
 {
+    uint64_t data, saved;
+    int ret = 0;
+
+    /* Otherwise an older state could be committed after a newer one, and
+     * still be recorded as the newer one */
+    xSemaphoreTake(ac_state_flush_lock, portMAX_DELAY);
+    taskENTER_CRITICAL(&ac_state_lock);
+    data = ac_state_pending;
+    saved = ac_state_saved;
+    taskEXIT_CRITICAL(&ac_state_lock);
+
+    if (data == saved)
+        goto Exit;
+
     if (nvs_set_u64(nvs, nvs_ac_state, data) != ESP_OK ||
         nvs_commit(nvs) != ESP_OK)
     {
         ESP_LOGE(TAG, "Failed saving AC state persistently");
-        return -1;
+        ret = -1;
+        goto Exit;
+    }
+
+    ESP_LOGD(TAG, "Saved AC state 0x%" PRIx64, data);
+    taskENTER_CRITICAL(&ac_state_lock);
+    ac_state_saved = data;
+    ac_state_pending_since = xTaskGetTickCount();
+    ac_state_commits++;
+    taskEXIT_CRITICAL(&ac_state_lock);
+
+Exit:
+    xSemaphoreGive(ac_state_flush_lock);
+    return ret;
+}
+
+static void ac_state_timer_cb(TimerHandle_t xTimer)
+{
+    config_ac_persistent_flush();
+}
+
+int config_ac_persistent_save(uint64_t data)
+{
+    TickType_t now = xTaskGetTickCount(), since;
+    uint64_t saved;
+
+    taskENTER_CRITICAL(&ac_state_lock);
+    /* The first change since the last commit starts the deadline */
+    if (ac_state_pending == ac_state_saved)
+        ac_state_pending_since = now;
+    ac_state_pending = data;
+    saved = ac_state_saved;
+    since = ac_state_pending_since;
+    taskEXIT_CRITICAL(&ac_state_lock);
+
+    /* Nothing changed since the last commit, no need to touch the flash */
+    if (data == saved)
+    {
+        if (ac_state_timer)
+            xTimerStop(ac_state_timer, 0);
+        return 0;
+    }
+
+    /* Coalesce bursts of changes into a single, deferred, commit. Each
+     * change pushes it back, up to a deadline, so a steady stream of changes
+     * can't keep it from ever being written */
+    if (!ac_state_timer ||
+        now - since >= pdMS_TO_TICKS(AC_STATE_COMMIT_MAX_DELAY_MS) ||
+        xTimerReset(ac_state_timer, 0) != pdPASS)
+    {
+        return config_ac_persistent_flush();
     }
 
     return 0;
@@ -399,9 +595,39 @@ uint64_t config_ac_persistent_load(void)
     uint64_t data = 0;
 
     nvs_get_u64(nvs, nvs_ac_state, &data);
+    ac_state_pending = ac_state_saved = data;
     return data;
 }
 
+uint32_t config_ac_persistent_commits_get(void)
+{
+    return ac_state_commits;
+}
+
+const char *config_ac_learned_protocol_get(void)
+{
+    static char protocol[32];
+    size_t len = sizeof(protocol);
+
+    if (nvs_get_str(nvs, nvs_ac_protocol, protocol, &len) != ESP_OK)
+        return NULL;
+
+    return protocol;
+}
+
+int config_ac_learned_protocol_set(const char *protocol)
+{
+    ESP_LOGD(TAG, "Saving learned AC protocol: %s", protocol);
+
+    if (nvs_set_str(nvs, nvs_ac_protocol, protocol) != ESP_OK ||
+        nvs_commit(nvs) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed saving learned AC protocol: %s", protocol);
+        return -1;
+    }
+
+    return 0;
+}
 
 /* Configuration Update */
 static int config_active_partition_get(void)
@@ -542,6 +768,14 @@ int config_initialize(void)
 
     ESP_LOGI(TAG, "Initializing configuration");
     ESP_ERROR_CHECK(nvs_open(nvs_namespace, NVS_READWRITE, &nvs));
+    if (!(ac_state_flush_lock = xSemaphoreCreateMutex()))
+        return -1;
+    /* Without the timer, every change is committed right away */
+    if (!(ac_state_timer = xTimerCreate("ac_state", pdMS_TO_TICKS(
+        AC_STATE_COMMIT_DELAY_MS), pdFALSE, NULL, ac_state_timer_cb)))
+    {
+        ESP_LOGE(TAG, "Failed creating AC state timer");
+    }
 
     partition = config_active_partition_get();
 
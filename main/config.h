@@ -27,6 +27,13 @@ const char *config_mqtt_username_get(void);
 const char *config_mqtt_password_get(void);
 uint8_t config_mqtt_qos_get(void);
 uint8_t config_mqtt_retained_get(void);
+uint8_t config_mqtt_json_state_get(void);
+uint16_t config_mqtt_offline_queue_size_get(void);
+const char *config_mqtt_offline_queue_overflow_get(void);
+uint8_t config_mqtt_offline_queue_persistent_get(void);
+const char *config_mqtt_topics_prefix_get(void);
+uint8_t config_mqtt_discovery_enabled_get(void);
+const char *config_mqtt_discovery_prefix_get(void);
 
 /* Network Configuration */
 config_network_type_t config_network_type_get(void);
@@ -51,9 +58,20 @@ uint16_t config_log_port_get(void);
 const char *config_time_ntp_server_get(void);
 const char *config_time_timezone_get(void);
 
+/* AC Configuration */
+const char *config_ac_protocol_get(void);
+uint8_t config_ac_adaptive_timing_get(void);
+uint8_t config_ac_passthrough_get(void);
+uint16_t config_ac_send_delay_get(void);
+const char *config_ac_ir_tx_encoder_get(void);
+
 /* AC Persistent settings */
 int config_ac_persistent_save(uint64_t data);
+int config_ac_persistent_flush(void);
 uint64_t config_ac_persistent_load(void);
+uint32_t config_ac_persistent_commits_get(void);
+const char *config_ac_learned_protocol_get(void);
+int config_ac_learned_protocol_set(const char *protocol);
 
 /* Configuration Update */
 int config_update_begin(config_update_handle_t **handle);
@@ -0,0 +1,158 @@
+#include "discovery.h"
+#include "mqtt.h"
+#include "topics.h"
+#include <ctype.h>
+#include <esp_log.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "DISCOVERY";
+
+/* Large enough for all topics, even with a long prefix and device name */
+#define DISCOVERY_PAYLOAD_SIZE 2048
+
+/* Internal state */
+static char *config_topic = NULL;
+static char *name = NULL;
+static char *payload = NULL;
+static size_t payload_len = 0;
+
+static void discovery_append(const char *fmt, ...)
+{
+    va_list ap;
+    int len;
+
+    /* Already truncated */
+    if (payload_len >= DISCOVERY_PAYLOAD_SIZE)
+        return;
+
+    va_start(ap, fmt);
+    len = vsnprintf(payload + payload_len,
+        DISCOVERY_PAYLOAD_SIZE - payload_len, fmt, ap);
+    va_end(ap);
+
+    payload_len += len;
+}
+
+/* Appends a JSON string, escaping quotes and backslashes */
+static void discovery_append_string(const char *str)
+{
+    discovery_append("\"");
+    for (; *str; str++)
+    {
+        if (*str == '"' || *str == '\\')
+            discovery_append("\\%c", *str);
+        else if ((unsigned char)*str >= ' ')
+            discovery_append("%c", *str);
+    }
+    discovery_append("\"");
+}
+
+static void discovery_append_field(const char *key, const char *value)
+{
+    discovery_append(",\"%s\":", key);
+    discovery_append_string(value);
+}
+
+static void discovery_append_topic(const char *key, topic_t topic)
+{
+    discovery_append_field(key, topic_get(topic));
+}
+
+static void discovery_append_list(const char *key, const char **values)
+{
+    discovery_append(",\"%s\":[", key);
+    for (; *values; values++)
+    {
+        discovery_append_string(*values);
+        if (values[1])
+            discovery_append(",");
+    }
+    discovery_append("]");
+}
+
+int discovery_climate_publish(const discovery_climate_t *climate,
+    uint8_t qos)
+{
+    if (!payload)
+        return -1;
+
+    payload_len = 0;
+    discovery_append("{\"name\":null");
+    discovery_append(",\"unique_id\":");
+    discovery_append_string(name);
+    discovery_append_topic("availability_topic", TOPIC_STATUS);
+    discovery_append_field("payload_available", "online");
+    discovery_append_field("payload_not_available", "offline");
+    discovery_append_topic("power_command_topic", TOPIC_POWER_SET);
+    discovery_append_field("payload_on", "on");
+    discovery_append_field("payload_off", "off");
+    discovery_append_topic("mode_state_topic", TOPIC_MODE);
+    discovery_append_topic("mode_command_topic", TOPIC_MODE_SET);
+    discovery_append_list("modes", climate->modes);
+    discovery_append_topic("temperature_state_topic", TOPIC_TEMPERATURE);
+    discovery_append_topic("temperature_command_topic",
+        TOPIC_TEMPERATURE_SET);
+    discovery_append(",\"min_temp\":%d,\"max_temp\":%d,\"temp_step\":1"
+        ",\"precision\":1.0", climate->min_temperature,
+        climate->max_temperature);
+    discovery_append_topic("fan_mode_state_topic", TOPIC_FAN);
+    discovery_append_topic("fan_mode_command_topic", TOPIC_FAN_SET);
+    discovery_append_list("fan_modes", climate->fans);
+    discovery_append_topic("action_topic", TOPIC_ACTION);
+    discovery_append(",\"qos\":%u", qos);
+    discovery_append(",\"device\":{\"identifiers\":[");
+    discovery_append_string(name);
+    discovery_append("]");
+    discovery_append_field("name", name);
+    discovery_append_field("manufacturer", "AC-MITM");
+    discovery_append_field("model", climate->model ? : "Learning");
+    discovery_append_field("sw_version", AC_MITM_VER);
+    discovery_append("}}");
+
+    if (payload_len >= DISCOVERY_PAYLOAD_SIZE)
+    {
+        ESP_LOGE(TAG, "Climate config doesn't fit in %d bytes",
+            DISCOVERY_PAYLOAD_SIZE);
+        return -1;
+    }
+
+    ESP_LOGD(TAG, "Publishing climate config to %s", config_topic);
+    return mqtt_publish(config_topic, (uint8_t *)payload, payload_len, qos,
+        1);
+}
+
+int discovery_initialize(const char *prefix, const char *device_name)
+{
+    size_t len = strlen(prefix) + strlen(device_name) +
+        sizeof("/climate//config");
+    char *p;
+
+    ESP_LOGD(TAG, "Initializing discovery under %s", prefix);
+
+    config_topic = malloc(len);
+    name = strdup(device_name);
+    payload = malloc(DISCOVERY_PAYLOAD_SIZE);
+    if (!config_topic || !name || !payload)
+    {
+        ESP_LOGE(TAG, "Failed allocating discovery buffers");
+        free(config_topic);
+        free(name);
+        free(payload);
+        payload = NULL;
+        return -1;
+    }
+
+    /* Node IDs are limited to [a-zA-Z0-9_-] */
+    snprintf(config_topic, len, "%s/climate/%s/config", prefix, device_name);
+    for (p = config_topic + strlen(prefix) + sizeof("/climate/") - 1;
+        p < config_topic + len - sizeof("/config"); p++)
+    {
+        if (!isalnum((unsigned char)*p) && *p != '-')
+            *p = '_';
+    }
+
+    return 0;
+}
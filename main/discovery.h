@@ -0,0 +1,24 @@
+#ifndef DISCOVERY_H
+#define DISCOVERY_H
+
+#include <stdint.h>
+
+/* Home Assistant MQTT discovery, the AC is announced as a climate entity */
+typedef struct {
+    /* NULL while the AC protocol is being learned */
+    const char *model;
+    int min_temperature;
+    int max_temperature;
+    /* NULL terminated, as published on the Mode and Fan topics */
+    const char **modes;
+    const char **fans;
+} discovery_climate_t;
+
+/* Publishes the retained climate entity config, once per connection */
+int discovery_climate_publish(const discovery_climate_t *climate,
+    uint8_t qos);
+
+/* The MQTT topics must already be initialized */
+int discovery_initialize(const char *prefix, const char *device_name);
+
+#endif
@@ -0,0 +1,80 @@
+#include "histogram.h"
+#include <stdint.h>
+
+static unsigned int histogram_bucket(uint32_t value)
+{
+    unsigned int msb;
+
+    if (value < HISTOGRAM_SUB_BUCKETS)
+        return value;
+
+    msb = 31 - __builtin_clz(value);
+    return (msb - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS +
+        ((value >> (msb - HISTOGRAM_SUB_BUCKET_BITS)) &
+        (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/* The largest value that falls in the bucket */
+static uint32_t histogram_bucket_max(unsigned int bucket)
+{
+    unsigned int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t base = HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS;
+
+    if (bucket < HISTOGRAM_SUB_BUCKETS)
+        return bucket;
+
+    return ((base + 1) << shift) - 1;
+}
+
+void histogram_add(histogram_t *histogram, uint32_t value)
+{
+    if (!histogram->count || value < histogram->min)
+        histogram->min = value;
+    if (value > histogram->max)
+        histogram->max = value;
+    histogram->total += value;
+    histogram->count++;
+    histogram->buckets[histogram_bucket(value)]++;
+}
+
+void histogram_merge(histogram_t *histogram, const histogram_t *other)
+{
+    int i;
+
+    if (!other->count)
+        return;
+
+    if (!histogram->count || other->min < histogram->min)
+        histogram->min = other->min;
+    if (other->max > histogram->max)
+        histogram->max = other->max;
+    histogram->total += other->total;
+    histogram->count += other->count;
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+        histogram->buckets[i] += other->buckets[i];
+}
+
+uint32_t histogram_avg(const histogram_t *histogram)
+{
+    return histogram->count ? histogram->total / histogram->count : 0;
+}
+
+uint32_t histogram_percentile(const histogram_t *histogram,
+    unsigned int percent)
+{
+    uint32_t threshold = ((uint64_t)histogram->count * percent + 99) / 100;
+    uint32_t sum = 0;
+    int i;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        if ((sum += histogram->buckets[i]) < threshold)
+            continue;
+
+        if (histogram_bucket_max(i) < histogram->max)
+            return histogram_bucket_max(i);
+        break;
+    }
+
+    return histogram->max;
+}
@@ -0,0 +1,29 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+/* Log-linear histogram, each power of two is split into 4 buckets so
+ * percentiles are within 25% while all of uint32_t fits in 128 buckets */
+#define HISTOGRAM_SUB_BUCKET_BITS 2
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS 128
+
+/* Types */
+typedef struct {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t total;
+    uint32_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+void histogram_add(histogram_t *histogram, uint32_t value);
+void histogram_merge(histogram_t *histogram, const histogram_t *other);
+
+uint32_t histogram_avg(const histogram_t *histogram);
+/* An upper bound of the percentile, never above the maximal value */
+uint32_t histogram_percentile(const histogram_t *histogram,
+    unsigned int percent);
+
+#endif
@@ -1,6 +1,9 @@
 #include "httpd.h"
+#include "capture.h"
 #include "httpd_static_files.h"
+#include "latency.h"
 #include "ota.h"
+#include "replay.h"
 #include <esp_err.h>
 #include <esp_log.h>
 #include <esp_http_server.h>
@@ -21,16 +24,30 @@ httpd_handle_t server = NULL;
 
 /* Callback functions */
 static httpd_on_ota_completed_cb_t on_ota_completed_cb = NULL;
+static httpd_on_restart_cb_t on_restart_cb = NULL;
 
 void httpd_set_on_ota_completed_cb(httpd_on_ota_completed_cb_t cb)
 {
     on_ota_completed_cb = cb;
 }
 
+void httpd_set_on_restart_cb(httpd_on_restart_cb_t cb)
+{
+    on_restart_cb = cb;
+}
+
 static void delayed_restart_timer_cb(TimerHandle_t xTimer)
 {
-    abort();
     xTimerDelete(xTimer, 0);
+
+    /* The application restarts once pending state is saved */
+    if (on_restart_cb)
+    {
+        on_restart_cb();
+        return;
+    }
+
+    abort();
 }
 
 static esp_err_t restart_handler(httpd_req_t *req)
@@ -51,6 +68,7 @@ static esp_err_t status_handler(httpd_req_t *req)
     cJSON *response = cJSON_CreateObject();
 
     cJSON_AddStringToObject(response, "version", AC_MITM_VER);
+    cJSON_AddItemToObject(response, "latency", latency_to_json());
 
     response_str = cJSON_PrintUnformatted(response);
     httpd_resp_set_type(req, "application/json");
@@ -61,6 +79,103 @@ static esp_err_t status_handler(httpd_req_t *req)
     return ret;
 }
 
+static esp_err_t capture_handler(httpd_req_t *req)
+{
+    esp_err_t ret;
+    uint8_t *blob;
+    size_t len;
+
+    if (!(blob = capture_export(&len)))
+        return httpd_resp_send_500(req);
+
+    httpd_resp_set_type(req, "application/octet-stream");
+    ret = httpd_resp_send(req, (char *)blob, len);
+
+    free(blob);
+    return ret;
+}
+
+static cJSON *replay_to_json(replay_t *replay)
+{
+    cJSON *results = cJSON_CreateObject();
+    cJSON *tolerances = cJSON_AddArrayToObject(results, "tolerances");
+    uint32_t frames = replay_frames_get(replay);
+    const replay_stats_t *stats;
+    unsigned int i;
+
+    cJSON_AddNumberToObject(results, "frames", frames);
+    for (i = 0; (stats = replay_stats_get(replay, i)); i++)
+    {
+        cJSON *result = cJSON_CreateObject();
+
+        cJSON_AddNumberToObject(result, "tolerance", stats->tolerance);
+        cJSON_AddNumberToObject(result, "matched",
+            stats->results[AC_REPLAY_MATCHED]);
+        cJSON_AddNumberToObject(result, "mismatched",
+            stats->results[AC_REPLAY_MISMATCHED]);
+        cJSON_AddNumberToObject(result, "failed",
+            stats->results[AC_REPLAY_FAILED]);
+        cJSON_AddNumberToObject(result, "failure_rate", frames ?
+            (double)stats->results[AC_REPLAY_FAILED] / frames : 0);
+        cJSON_AddNumberToObject(result, "frames_per_sec", stats->time_us.total ?
+            frames * 1000000.0 / stats->time_us.total : 0);
+        cJSON_AddNumberToObject(result, "p50_us",
+            histogram_percentile(&stats->time_us, 50));
+        cJSON_AddNumberToObject(result, "p99_us",
+            histogram_percentile(&stats->time_us, 99));
+        cJSON_AddNumberToObject(result, "max_us", stats->time_us.max);
+        cJSON_AddItemToArray(tolerances, result);
+    }
+
+    return results;
+}
+
+static esp_err_t replay_handler(httpd_req_t *req)
+{
+    esp_err_t ret;
+    char buf[1024], *response_str;
+    int len = 0;
+    size_t total_received = 0;
+    replay_t *replay;
+    cJSON *response;
+
+    if (!(replay = replay_start()))
+        return httpd_resp_send_500(req);
+
+    /* The corpus is streamed, it may be much larger than the free memory */
+    while (req->content_len - total_received > 0)
+    {
+        if ((len = httpd_req_recv(req, buf, sizeof(buf))) <= 0)
+        {
+            if (len == HTTPD_SOCK_ERR_TIMEOUT)
+                continue;
+            break;
+        }
+        total_received += len;
+        if (replay_feed(replay, (uint8_t *)buf, len))
+        {
+            len = -1;
+            break;
+        }
+    }
+
+    if (len < 0)
+    {
+        replay_free(replay);
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, NULL);
+    }
+
+    response = replay_to_json(replay);
+    response_str = cJSON_PrintUnformatted(response);
+    httpd_resp_set_type(req, "application/json");
+    ret = httpd_resp_sendstr(req, response_str);
+
+    cJSON_free(response_str);
+    cJSON_Delete(response);
+    replay_free(replay);
+    return ret;
+}
+
 static int register_management_routes(httpd_handle_t server)
 {
     httpd_uri_t uri_restart = {
@@ -75,9 +190,23 @@ static int register_management_routes(httpd_handle_t server)
         .handler  = status_handler,
         .user_ctx = NULL,
     };
+    httpd_uri_t uri_capture = {
+        .uri      = "/capture",
+        .method   = HTTP_GET,
+        .handler  = capture_handler,
+        .user_ctx = NULL,
+    };
+    httpd_uri_t uri_replay = {
+        .uri      = "/replay",
+        .method   = HTTP_POST,
+        .handler  = replay_handler,
+        .user_ctx = NULL,
+    };
 
     httpd_register_uri_handler(server, &uri_restart);
     httpd_register_uri_handler(server, &uri_status);
+    httpd_register_uri_handler(server, &uri_capture);
+    httpd_register_uri_handler(server, &uri_replay);
 
     return 0;
 }
@@ -5,9 +5,11 @@
 
 /* Event callback types */
 typedef void (*httpd_on_ota_completed_cb_t)(ota_type_t type, ota_err_t err);
+typedef void (*httpd_on_restart_cb_t)(void);
 
 /* Event handlers */
 void httpd_set_on_ota_completed_cb(httpd_on_ota_completed_cb_t cb);
+void httpd_set_on_restart_cb(httpd_on_restart_cb_t cb);
 
 int httpd_initialize(void);
 
@@ -1,4 +1,6 @@
 #include "ir.h"
+#include "latency.h"
+#include "manchester_encoder.h"
 #include <driver/rmt_types.h>
 #include <driver/rmt_rx.h>
 #include <driver/rmt_tx.h>
@@ -6,16 +8,51 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <esp_timer.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 static const char *TAG = "IR";
 static const uint32_t IR_RESOLUTION_HZ = 1000000UL; /* uS */
+#define IR_RX_BUFFER_SYMBOLS 512
+#define IR_RX_BUFFERS 3
 
 static ir_on_recv_cb_t on_recv_cb = NULL;
 static QueueHandle_t receive_queue = NULL;
+static QueueHandle_t free_rx_buffers = NULL;
 static rmt_channel_handle_t tx_channel = NULL;
 static rmt_encoder_handle_t copy_encoder = NULL;
+static rmt_encoder_handle_t manchester_encoder = NULL;
+static ir_tx_encoder_t tx_encoder = IR_TX_ENCODER_STREAMING;
+/* The RMT driver reads the payload while sending, one slot per queued frame */
+static manchester_frame_t manchester_frames[IR_TX_QUEUE_DEPTH];
+static unsigned int manchester_frame_next = 0;
+static atomic_uint tx_in_flight = 0;
+static SemaphoreHandle_t tx_lock = NULL;
+static int64_t rx_time = 0;
+
+/* Generated IR frames, kept until they're the least recently used. The cache
+ * is larger than the RMT queue, so an evicted frame is never still in flight */
+#define FRAME_CACHE_SIZE (IR_TX_QUEUE_DEPTH + 1)
+
+typedef struct {
+    const manchester_protocol_t *protocol;
+    uint64_t value;
+    uint32_t last_used;
+    size_t size;
+    rmt_symbol_word_t *symbols;
+} frame_cache_entry_t;
+
+static frame_cache_entry_t frame_cache[FRAME_CACHE_SIZE] = {};
+static uint32_t frame_cache_clock = 0;
+
+/* Origins are queued along with the RMT transactions and popped as each one
+ * completes */
+static int64_t tx_origins[IR_TX_QUEUE_DEPTH];
+static unsigned int tx_origins_head = 0, tx_origins_tail = 0;
 
 /* Event handlers */
 void ir_set_on_recv_cb(ir_on_recv_cb_t cb)
@@ -23,77 +60,249 @@ void ir_set_on_recv_cb(ir_on_recv_cb_t cb)
     on_recv_cb = cb;
 }
 
+typedef struct {
+    rmt_rx_done_event_data_t data;
+    int64_t time;
+} rx_done_event_t;
+
 static bool rmt_recv_done(rmt_channel_handle_t rx_chan,
     const rmt_rx_done_event_data_t *edata, void *user_data)
 {
     QueueHandle_t receive_queue = (QueueHandle_t)user_data;
     BaseType_t high_task_wakeup = pdFALSE;
+    rx_done_event_t event = {
+        .data = *edata,
+        .time = esp_timer_get_time(),
+    };
 
-    xQueueSendFromISR(receive_queue, edata, &high_task_wakeup);
+    xQueueSendFromISR(receive_queue, &event, &high_task_wakeup);
 
     return high_task_wakeup == pdTRUE;
 }
 
+void ir_recv_release(rmt_symbol_word_t *symbols)
+{
+    xQueueSend(free_rx_buffers, &symbols, portMAX_DELAY);
+}
+
 static void ir_task(void *pvParameter)
 {
     rmt_channel_handle_t rx_channel = (rmt_channel_handle_t)pvParameter;
-    rmt_symbol_word_t *raw_symbols = malloc(sizeof(*raw_symbols) * 512);
+    rmt_symbol_word_t *raw_symbols = NULL;
     rmt_receive_config_t receive_config = {
         .signal_range_min_ns = 1250,     // the shortest duration for NEC signal is 560us, 1250ns < 560us, valid signal won't be treated as noise
         .signal_range_max_ns = 12000000, // the longest duration for NEC signal is 9000us, 12000000ns > 9000us, the receive won't stop early
     };
-    rmt_rx_done_event_data_t rx_data;
+    rx_done_event_t rx_done;
 
     while (1)
     {
+        /* Wait for a buffer that isn't owned by the consumer */
+        if (!raw_symbols &&
+            xQueueReceive(free_rx_buffers, &raw_symbols, portMAX_DELAY) != pdPASS)
+        {
+            continue;
+        }
+
         // ready to receive
-        ESP_ERROR_CHECK(rmt_receive(rx_channel, raw_symbols, sizeof(*raw_symbols) * 512, &receive_config));
+        ESP_ERROR_CHECK(rmt_receive(rx_channel, raw_symbols, sizeof(*raw_symbols) * IR_RX_BUFFER_SYMBOLS, &receive_config));
 
         // wait for RX done signal
-        if (xQueueReceive(receive_queue, &rx_data, portMAX_DELAY) != pdPASS)
+        if (xQueueReceive(receive_queue, &rx_done, portMAX_DELAY) != pdPASS)
             continue;
 
         /* Ignore short, probably, random noise */
-        if (rx_data.num_symbols < 5)
+        if (rx_done.data.num_symbols < 5)
             continue;
 
-        ESP_LOGI(TAG, "Got %zd IR symbols", rx_data.num_symbols);
+        ESP_LOGI(TAG, "Got %zd IR symbols", rx_done.data.num_symbols);
+        rx_time = rx_done.time;
+
+        /* Ownership of the buffer moves to the callback until it's released */
         if (on_recv_cb)
-            on_recv_cb(rx_data.received_symbols, rx_data.num_symbols);
-#if 0
-        uint64_t val = parse_manchester(&rx_data, 3 * 950, 3 * 950, 950);
-        printf("Parsed value: 0x%" PRIx64 "\n", val);
-        if (!val)
         {
-            printf("Failed parsing command, ignoring\n");
-            continue;
+            on_recv_cb(raw_symbols, rx_done.data.num_symbols);
+            raw_symbols = NULL;
         }
-
-        airwell_t value = { .raw = val };
-        printf("Power toggle: %d, mode: %d, fan: %d, temp: %dC\n", value.power_toggle, value.mode, value.fan, value.temp + 15);
-#endif
     }
 
     vTaskDelete(NULL);
 }
 
-int ir_send(rmt_symbol_word_t *symbols, size_t len)
+int64_t ir_recv_time_get(void)
+{
+    return rx_time;
+}
+
+static bool rmt_trans_done(rmt_channel_handle_t tx_chan,
+    const rmt_tx_done_event_data_t *edata, void *user_data)
+{
+    latency_record(LATENCY_STAGE_TX_DONE, tx_origins[tx_origins_tail]);
+    tx_origins_tail = (tx_origins_tail + 1) % IR_TX_QUEUE_DEPTH;
+    atomic_fetch_sub(&tx_in_flight, 1);
+
+    return false;
+}
+
+/* Must be called with tx_lock held */
+static int ir_transmit(rmt_encoder_handle_t encoder, const void *data,
+    size_t len, int64_t origin)
 {
     rmt_transmit_config_t transmit_config = {
         .loop_count = 0, // no loop
         .flags.eot_level = 1,
     };
-    return rmt_transmit(tx_channel, copy_encoder, symbols, len, &transmit_config);
+
+    if (atomic_fetch_add(&tx_in_flight, 1) >= IR_TX_QUEUE_DEPTH)
+    {
+        ESP_LOGE(TAG, "IR transmit queue is full");
+        atomic_fetch_sub(&tx_in_flight, 1);
+        return -1;
+    }
+
+    /* The transaction can't complete before it's queued, so its origin can be
+     * taken back if queuing fails */
+    tx_origins[tx_origins_head] = origin;
+    if (rmt_transmit(tx_channel, encoder, data, len, &transmit_config))
+    {
+        atomic_fetch_sub(&tx_in_flight, 1);
+        return -1;
+    }
+    tx_origins_head = (tx_origins_head + 1) % IR_TX_QUEUE_DEPTH;
+
+    return 0;
+}
+
+size_t ir_tx_in_flight_get(void)
+{
+    return atomic_load(&tx_in_flight);
+}
+
+int ir_send(rmt_symbol_word_t *symbols, size_t len)
+{
+    int ret;
+
+    xSemaphoreTake(tx_lock, portMAX_DELAY);
+    ret = ir_transmit(copy_encoder, symbols, len, 0);
+    xSemaphoreGive(tx_lock);
+
+    return ret;
+}
+
+/* Must be called with tx_lock held */
+static rmt_symbol_word_t *frame_cache_get(const manchester_protocol_t *protocol,
+    uint64_t value, size_t size)
+{
+    frame_cache_entry_t *entry = NULL, *lru = &frame_cache[0];
+    int i;
+
+    for (i = 0; i < FRAME_CACHE_SIZE; i++)
+    {
+        if (frame_cache[i].last_used && frame_cache[i].protocol == protocol &&
+            frame_cache[i].value == value)
+        {
+            entry = &frame_cache[i];
+            break;
+        }
+        if (frame_cache[i].last_used < lru->last_used)
+            lru = &frame_cache[i];
+    }
+
+    if (!entry)
+    {
+        ESP_LOGD(TAG, "Generating IR symbols for 0x%" PRIx64, value);
+        entry = lru;
+        entry->last_used = 0;
+
+        /* Buffers are allocated on first use, and only grow */
+        if (entry->size < size)
+        {
+            free(entry->symbols);
+            entry->size = 0;
+            if (!(entry->symbols = malloc(size)))
+                return NULL;
+            entry->size = size;
+        }
+
+        if (generate_manchester(protocol, value, entry->symbols, size))
+            return NULL;
+        entry->protocol = protocol;
+        entry->value = value;
+    }
+
+    entry->last_used = ++frame_cache_clock;
+    return entry->symbols;
+}
+
+/* Must be called with tx_lock held */
+static int ir_send_manchester_cached(const manchester_protocol_t *protocol,
+    uint64_t value, int64_t origin)
+{
+    size_t size = manchester_frame_size(protocol);
+    rmt_symbol_word_t *symbols;
+
+    if (!(symbols = frame_cache_get(protocol, value, size)))
+    {
+        ESP_LOGE(TAG, "Failed generating IR symbols");
+        return -1;
+    }
+
+    return ir_transmit(copy_encoder, symbols, size, origin);
+}
+
+int ir_send_manchester(const manchester_protocol_t *protocol, uint64_t value,
+    int64_t origin)
+{
+    manchester_frame_t *frame;
+    int ret = -1;
+
+    /* The slot check and the reservation in ir_transmit() must not be
+     * interleaved with another transmission */
+    xSemaphoreTake(tx_lock, portMAX_DELAY);
+
+    if (tx_encoder == IR_TX_ENCODER_CACHED)
+    {
+        ret = ir_send_manchester_cached(protocol, value, origin);
+        goto out;
+    }
+
+    /* Slots are reused in order, and the in-flight guard in ir_transmit()
+     * guarantees the oldest one was already sent */
+    if (ir_tx_in_flight_get() >= IR_TX_QUEUE_DEPTH)
+    {
+        ESP_LOGE(TAG, "IR transmit queue is full");
+        goto out;
+    }
+
+    frame = &manchester_frames[manchester_frame_next];
+    frame->protocol = protocol;
+    frame->value = value;
+    if ((ret = ir_transmit(manchester_encoder, frame, sizeof(*frame), origin)))
+        goto out;
+
+    manchester_frame_next = (manchester_frame_next + 1) % IR_TX_QUEUE_DEPTH;
+
+out:
+    xSemaphoreGive(tx_lock);
+    return ret;
 }
 
-int ir_initialize(int rx_gpio, int tx_gpio)
+ir_tx_encoder_t ir_tx_encoder_atoencoder(const char *encoder)
+{
+    if (encoder && !strcmp(encoder, "cached"))
+        return IR_TX_ENCODER_CACHED;
+
+    return IR_TX_ENCODER_STREAMING;
+}
+
+int ir_initialize(int rx_gpio, int tx_gpio, ir_tx_encoder_t encoder)
 {
     ESP_LOGI(TAG, "Initializing IR");
 
     rmt_rx_channel_config_t rx_channel_cfg = {
         .clk_src = RMT_CLK_SRC_DEFAULT,
         .resolution_hz = IR_RESOLUTION_HZ,
-        .mem_block_symbols = 512,
+        .mem_block_symbols = IR_RX_BUFFER_SYMBOLS,
         .gpio_num = rx_gpio,
 #ifdef SOC_RMT_SUPPORT_DMA
         .flags.with_dma = 1,
@@ -102,12 +311,15 @@ int ir_initialize(int rx_gpio, int tx_gpio)
     rmt_rx_event_callbacks_t cbs = {
         .on_recv_done = rmt_recv_done,
     };
+    rmt_tx_event_callbacks_t tx_cbs = {
+        .on_trans_done = rmt_trans_done,
+    };
     rmt_channel_handle_t rx_channel = NULL;
     rmt_tx_channel_config_t tx_channel_cfg = {
         .clk_src = RMT_CLK_SRC_DEFAULT,
         .resolution_hz = IR_RESOLUTION_HZ,
         .mem_block_symbols = 512,
-        .trans_queue_depth = 4,
+        .trans_queue_depth = IR_TX_QUEUE_DEPTH,
         .gpio_num = tx_gpio,
         .flags.invert_out = 1,
 #ifdef SOC_RMT_SUPPORT_DMA
@@ -115,15 +327,35 @@ int ir_initialize(int rx_gpio, int tx_gpio)
 #endif
     };
 
-    receive_queue = xQueueCreate(1, sizeof(rmt_rx_done_event_data_t));
+    tx_encoder = encoder;
+    receive_queue = xQueueCreate(1, sizeof(rx_done_event_t));
+    tx_lock = xSemaphoreCreateMutex();
+    free_rx_buffers = xQueueCreate(IR_RX_BUFFERS, sizeof(rmt_symbol_word_t *));
+    for (int i = 0; i < IR_RX_BUFFERS; i++)
+    {
+        rmt_symbol_word_t *buffer =
+            malloc(sizeof(*buffer) * IR_RX_BUFFER_SYMBOLS);
+
+        if (!buffer)
+        {
+            ESP_LOGE(TAG, "Failed allocating IR receive buffers");
+            return -1;
+        }
+        xQueueSend(free_rx_buffers, &buffer, 0);
+    }
     ESP_ERROR_CHECK(rmt_new_rx_channel(&rx_channel_cfg, &rx_channel));
     ESP_ERROR_CHECK(rmt_rx_register_event_callbacks(rx_channel, &cbs, receive_queue));
 
     ESP_ERROR_CHECK(rmt_new_tx_channel(&tx_channel_cfg, &tx_channel));
-
+    ESP_ERROR_CHECK(rmt_tx_register_event_callbacks(tx_channel, &tx_cbs, NULL));
 
     rmt_copy_encoder_config_t copy_encoder_config = {};
     ESP_ERROR_CHECK(rmt_new_copy_encoder(&copy_encoder_config, &copy_encoder));
+    if (manchester_encoder_new(&manchester_encoder))
+    {
+        ESP_LOGE(TAG, "Failed creating Manchester encoder");
+        return -1;
+    }
 
     ESP_ERROR_CHECK(rmt_enable(tx_channel));
     ESP_ERROR_CHECK(rmt_enable(rx_channel));
@@ -135,11 +367,7 @@ int ir_initialize(int rx_gpio, int tx_gpio)
         .level1 = 1,
         .duration1 = 0x7FFF,
     };
-    rmt_transmit_config_t transmit_config = {
-        .loop_count = 0, // no loop
-        .flags.eot_level = 1,
-    };
-    ESP_ERROR_CHECK(rmt_transmit(tx_channel, copy_encoder, &footer, sizeof(footer), &transmit_config));
+    ESP_ERROR_CHECK(ir_send(&footer, sizeof(footer)));
 
     if (xTaskCreatePinnedToCore(ir_task, "ir_task",
         4096, rx_channel, 5,
@@ -1,16 +1,40 @@
 #ifndef IR_H
 #define IR_H
 
+#include "protocol_parsers.h"
 #include <driver/rmt_types.h>
 #include <stddef.h>
 
+/* Maximal number of frames queued to, or being sent by, the RMT peripheral */
+#define IR_TX_QUEUE_DEPTH 4
+
+/* Types */
+typedef enum {
+    /* Symbols are generated on the fly, while the RMT sends them */
+    IR_TX_ENCODER_STREAMING,
+    /* Symbols are generated once and reused for repeated frames */
+    IR_TX_ENCODER_CACHED,
+} ir_tx_encoder_t;
+
 /* Event callback types */
+/* The received symbols are owned by the callee until ir_recv_release() */
 typedef void (*ir_on_recv_cb_t)(rmt_symbol_word_t *symbols, size_t len);
 
 /* Event handlers */
 void ir_set_on_recv_cb(ir_on_recv_cb_t cb);
 
-int ir_initialize(int rx_gpio, int tx_gpio);
+void ir_recv_release(rmt_symbol_word_t *symbols);
+/* When the capture passed to the callback ended, in uS since boot */
+int64_t ir_recv_time_get(void);
+
+ir_tx_encoder_t ir_tx_encoder_atoencoder(const char *encoder);
+
+int ir_initialize(int rx_gpio, int tx_gpio, ir_tx_encoder_t encoder);
 int ir_send(rmt_symbol_word_t *symbols, size_t len);
+/* Streams the frame, or sends its cached symbols, depending on the encoder.
+ * The origin is the time of the capture that triggered it, or 0 */
+int ir_send_manchester(const manchester_protocol_t *protocol, uint64_t value,
+    int64_t origin);
+size_t ir_tx_in_flight_get(void);
 
 #endif
@@ -0,0 +1,212 @@
+#include "ir_decoder.h"
+#include "protocol_parsers.h"
+#include <driver/rmt_types.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <stdint.h>
+#include <string.h>
+
+static const char *TAG = "IR_DECODER";
+
+/* Header marks and spaces are bucketed by their top bits, each bucket holds a
+ * bitmap of the protocols whose header windows overlap it */
+#define IR_DECODER_MAX_PROTOCOLS 16
+#define HEADER_BUCKET_SHIFT 8 /* 256uS */
+#define HEADER_BUCKETS ((0x7FFF >> HEADER_BUCKET_SHIFT) + 1)
+
+static ir_protocol_t *protocols[IR_DECODER_MAX_PROTOCOLS] = {};
+static size_t protocols_count = 0;
+/* Per frame, a frame may fail with several protocols before one decodes it */
+static uint32_t frames_decoded = 0, frames_failed = 0;
+static uint16_t header_mark_dispatch[HEADER_BUCKETS] = {};
+static uint16_t header_space_dispatch[HEADER_BUCKETS] = {};
+
+/* Generic remotes, registered so their frames are identified as such rather
+ * than as failed AC frames */
+static pulse_protocol_t nec_protocol = {
+    .header_mark = 9000,
+    .header_space = 4500,
+    .zero_mark = 560,
+    .zero_space = 560,
+    .one_mark = 560,
+    .one_space = 1690,
+    .bits = 32,
+    .lsb_first = 1,
+};
+
+static pulse_protocol_t sirc_protocol = {
+    .header_mark = 2400,
+    .header_space = 600,
+    .zero_mark = 600,
+    .zero_space = 600,
+    .one_mark = 1200,
+    .one_space = 600,
+    .bits = 12,
+    .lsb_first = 1,
+};
+
+static ir_protocol_t nec = {
+    .name = "NEC",
+    .coding = IR_CODING_PULSE_DISTANCE,
+    .pulse = &nec_protocol,
+};
+
+static ir_protocol_t sirc = {
+    .name = "SIRC",
+    .coding = IR_CODING_PULSE_WIDTH,
+    .pulse = &sirc_protocol,
+};
+
+static ir_protocol_t *builtin_protocols[] = {
+    &nec,
+    &sirc,
+    NULL
+};
+
+static void dispatch_add(uint16_t *dispatch, timing_window_t window,
+    uint16_t mask)
+{
+    for (int i = window.lo >> HEADER_BUCKET_SHIFT;
+        i <= window.hi >> HEADER_BUCKET_SHIFT && i < HEADER_BUCKETS; i++)
+    {
+        dispatch[i] |= mask;
+    }
+}
+
+int ir_decoder_register(ir_protocol_t *protocol)
+{
+    timing_window_t mark, space;
+    uint16_t mask;
+
+    for (int i = 0; i < protocols_count; i++)
+    {
+        if (protocols[i] == protocol)
+            return 0;
+    }
+
+    if (protocols_count == IR_DECODER_MAX_PROTOCOLS)
+    {
+        ESP_LOGE(TAG, "Too many IR protocols, can't register %s",
+            protocol->name);
+        return -1;
+    }
+
+    switch (protocol->coding)
+    {
+    case IR_CODING_MANCHESTER:
+        manchester_protocol_init(protocol->manchester);
+        manchester_protocol_header_bounds(protocol->manchester, &mark, &space);
+        break;
+    case IR_CODING_PULSE_DISTANCE:
+    case IR_CODING_PULSE_WIDTH:
+        pulse_protocol_init(protocol->pulse);
+        mark = protocol->pulse->windows.header_mark;
+        space = protocol->pulse->windows.header_space;
+        break;
+    default:
+        return -1;
+    }
+
+    mask = 1 << protocols_count;
+    dispatch_add(header_mark_dispatch, mark, mask);
+    dispatch_add(header_space_dispatch, space, mask);
+    memset(&protocol->stats, 0, sizeof(protocol->stats));
+    protocols[protocols_count++] = protocol;
+
+    ESP_LOGI(TAG, "Registered IR protocol %s", protocol->name);
+    return 0;
+}
+
+void ir_decoder_foreach(ir_decoder_foreach_cb_t cb, void *ctx)
+{
+    for (int i = 0; i < protocols_count; i++)
+        cb(protocols[i], ctx);
+}
+
+static uint64_t decode(ir_protocol_t *protocol, rmt_symbol_word_t *symbols,
+    size_t len)
+{
+    switch (protocol->coding)
+    {
+    case IR_CODING_MANCHESTER:
+        return parse_manchester(protocol->manchester, symbols, len);
+    case IR_CODING_PULSE_DISTANCE:
+    case IR_CODING_PULSE_WIDTH:
+        return parse_pulse(protocol->pulse, symbols, len);
+    }
+
+    return 0;
+}
+
+static inline uint16_t header_candidates(const rmt_symbol_word_t *symbol)
+{
+    return header_mark_dispatch[symbol->duration0 >> HEADER_BUCKET_SHIFT] &
+        header_space_dispatch[symbol->duration1 >> HEADER_BUCKET_SHIFT];
+}
+
+ir_protocol_t *ir_decoder_decode(rmt_symbol_word_t *symbols, size_t len,
+    uint64_t *value)
+{
+    uint16_t candidates, tried = 0;
+    size_t index;
+
+    /* Captures may start with noise, or with the tail of a previous frame, so
+     * only run the decoders whose header matches, from where it's found */
+    for (index = 0; index < len; index++)
+    {
+        candidates = header_candidates(&symbols[index]) & ~tried;
+
+        while (candidates)
+        {
+            int i = __builtin_ctz(candidates);
+            ir_protocol_t *protocol = protocols[i];
+            int64_t start = esp_timer_get_time();
+            uint32_t elapsed;
+
+            candidates &= candidates - 1;
+            /* Manchester decoders look for each repeat's header on their own,
+             * there's no point in retrying them further on */
+            if (protocol->coding == IR_CODING_MANCHESTER)
+                tried |= 1 << i;
+            *value = decode(protocol, &symbols[index], len - index);
+
+            elapsed = esp_timer_get_time() - start;
+            protocol->stats.total_time_us += elapsed;
+            if (elapsed > protocol->stats.max_time_us)
+                protocol->stats.max_time_us = elapsed;
+
+            if (*value)
+            {
+                protocol->stats.decoded++;
+                frames_decoded++;
+                ESP_LOGD(TAG, "Decoded %s frame at symbol %zu in %" PRIu32
+                    "uS", protocol->name, index, elapsed);
+                return protocol;
+            }
+            protocol->stats.failed++;
+        }
+    }
+
+    ESP_LOGD(TAG, "No IR protocol matched %zu symbols", len);
+    frames_failed++;
+    return NULL;
+}
+
+void ir_decoder_frames_get(uint32_t *decoded, uint32_t *failed)
+{
+    *decoded = frames_decoded;
+    *failed = frames_failed;
+}
+
+int ir_decoder_initialize(void)
+{
+    ir_protocol_t **iter;
+
+    for (iter = builtin_protocols; *iter; iter++)
+    {
+        if (ir_decoder_register(*iter))
+            return -1;
+    }
+
+    return 0;
+}
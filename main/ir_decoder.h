@@ -0,0 +1,47 @@
+#ifndef IR_DECODER_H
+#define IR_DECODER_H
+
+#include "protocol_parsers.h"
+#include <driver/rmt_types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Types */
+typedef enum {
+    IR_CODING_MANCHESTER,
+    IR_CODING_PULSE_DISTANCE,
+    IR_CODING_PULSE_WIDTH,
+} ir_coding_t;
+
+typedef struct {
+    uint32_t decoded;
+    uint32_t failed;
+    uint64_t total_time_us;
+    uint32_t max_time_us;
+} ir_decoder_stats_t;
+
+typedef struct {
+    const char *name;
+    ir_coding_t coding;
+    union {
+        manchester_protocol_t *manchester;
+        pulse_protocol_t *pulse;
+    };
+    ir_decoder_stats_t stats;
+} ir_protocol_t;
+
+typedef void (*ir_decoder_foreach_cb_t)(const ir_protocol_t *protocol,
+    void *ctx);
+
+int ir_decoder_register(ir_protocol_t *protocol);
+void ir_decoder_foreach(ir_decoder_foreach_cb_t cb, void *ctx);
+
+/* Returns the protocol the frame was decoded with, or NULL */
+ir_protocol_t *ir_decoder_decode(rmt_symbol_word_t *symbols, size_t len,
+    uint64_t *value);
+/* Number of frames decoded by any protocol, or by none */
+void ir_decoder_frames_get(uint32_t *decoded, uint32_t *failed);
+
+int ir_decoder_initialize(void);
+
+#endif
@@ -0,0 +1,217 @@
+#include "journal.h"
+#include <esp_log.h>
+#include <esp_partition.h>
+#include <esp_rom_crc.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/timers.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "JOURNAL";
+
+#define JOURNAL_MAGIC 0x4a52
+#define JOURNAL_SECTOR_SIZE 4096
+#define JOURNAL_BATCH_SIZE 512
+#define JOURNAL_FLUSH_DELAY_MS 2000
+
+/* Types */
+typedef struct {
+    uint16_t magic;
+    uint16_t len;
+    uint32_t crc;
+} __attribute__((packed)) journal_record_t;
+
+/* Internal state */
+static const esp_partition_t *partition = NULL;
+static SemaphoreHandle_t journal_lock = NULL;
+static TimerHandle_t flush_timer = NULL;
+/* Records are written at offset, once the batch is flushed */
+static size_t offset = 0;
+static uint8_t batch[JOURNAL_BATCH_SIZE];
+static size_t batch_len = 0;
+/* Replay stopped at something other than erased flash */
+static uint8_t is_torn = 0;
+
+/* Must be called with journal_lock held */
+static int journal_write(const void *data, size_t len)
+{
+    if (esp_partition_write(partition, offset, data, len))
+    {
+        ESP_LOGE(TAG, "Failed writing %zu bytes at 0x%zx", len, offset);
+        return -1;
+    }
+
+    offset += len;
+    return 0;
+}
+
+static int journal_batch_flush(void)
+{
+    int ret = 0;
+
+    if (batch_len)
+        ret = journal_write(batch, batch_len);
+    batch_len = 0;
+
+    return ret;
+}
+
+int journal_replay(journal_replay_cb_t cb, void *ctx)
+{
+    journal_record_t record;
+    uint8_t *data = NULL;
+    size_t pos = 0;
+
+    if (!partition)
+        return -1;
+
+    xSemaphoreTake(journal_lock, portMAX_DELAY);
+    while (pos + sizeof(record) <= partition->size)
+    {
+        if (esp_partition_read(partition, pos, &record, sizeof(record)) ||
+            record.magic != JOURNAL_MAGIC ||
+            pos + sizeof(record) + record.len > partition->size ||
+            !(data = malloc(record.len ? : 1)) ||
+            esp_partition_read(partition, pos + sizeof(record), data,
+            record.len) ||
+            esp_rom_crc32_le(0, data, record.len) != record.crc)
+        {
+            break;
+        }
+
+        cb(data, record.len, ctx);
+        free(data);
+        data = NULL;
+        pos += sizeof(record) + record.len;
+    }
+    free(data);
+
+    /* Whatever follows the last complete record, e.g. a torn write, can't be
+     * appended to before it's erased */
+    if (pos + sizeof(record) <= partition->size &&
+        (esp_partition_read(partition, pos, &record, sizeof(record)) ||
+        record.magic != 0xffff))
+    {
+        ESP_LOGW(TAG, "Journal is torn at 0x%zx", pos);
+        is_torn = 1;
+    }
+    offset = pos;
+    xSemaphoreGive(journal_lock);
+
+    ESP_LOGI(TAG, "Replayed %zu bytes", pos);
+    return 0;
+}
+
+int journal_append(const void *data, size_t len)
+{
+    journal_record_t record = {
+        .magic = JOURNAL_MAGIC,
+        .len = len,
+        .crc = esp_rom_crc32_le(0, data, len),
+    };
+    size_t size = sizeof(record) + len;
+    int ret = -1;
+
+    if (!partition || len > UINT16_MAX)
+        return -1;
+
+    xSemaphoreTake(journal_lock, portMAX_DELAY);
+    if (is_torn || offset + batch_len + size > partition->size)
+        goto out;
+
+    if (batch_len + size > sizeof(batch) && journal_batch_flush())
+        goto out;
+
+    /* Too large to be batched */
+    if (size > sizeof(batch))
+    {
+        ret = journal_write(&record, sizeof(record)) ||
+            journal_write(data, len) ? -1 : 0;
+        goto out;
+    }
+
+    memcpy(batch + batch_len, &record, sizeof(record));
+    memcpy(batch + batch_len + sizeof(record), data, len);
+    batch_len += size;
+    ret = 0;
+
+    if (!xTimerIsTimerActive(flush_timer))
+        xTimerStart(flush_timer, 0);
+
+out:
+    xSemaphoreGive(journal_lock);
+    return ret;
+}
+
+int journal_flush(void)
+{
+    int ret;
+
+    if (!partition)
+        return -1;
+
+    xSemaphoreTake(journal_lock, portMAX_DELAY);
+    ret = journal_batch_flush();
+    xSemaphoreGive(journal_lock);
+
+    return ret;
+}
+
+int journal_clear(void)
+{
+    size_t used;
+    int ret = 0;
+
+    if (!partition)
+        return -1;
+
+    xSemaphoreTake(journal_lock, portMAX_DELAY);
+    batch_len = 0;
+
+    /* Only the sectors that were written to need erasing, unless it's unknown
+     * how far a torn write got */
+    used = is_torn ? partition->size : (offset + JOURNAL_SECTOR_SIZE - 1) /
+        JOURNAL_SECTOR_SIZE * JOURNAL_SECTOR_SIZE;
+
+    if (used && esp_partition_erase_range(partition, 0, used))
+    {
+        ESP_LOGE(TAG, "Failed erasing journal");
+        ret = -1;
+    }
+    else
+    {
+        offset = 0;
+        is_torn = 0;
+    }
+    xSemaphoreGive(journal_lock);
+
+    return ret;
+}
+
+static void flush_timer_cb(TimerHandle_t xTimer)
+{
+    journal_flush();
+}
+
+int journal_initialize(const char *partition_label)
+{
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+        ESP_PARTITION_SUBTYPE_ANY, partition_label);
+    if (!partition)
+    {
+        ESP_LOGE(TAG, "Failed finding partition %s", partition_label);
+        return -1;
+    }
+
+    journal_lock = xSemaphoreCreateMutex();
+    flush_timer = xTimerCreate("journal", pdMS_TO_TICKS(
+        JOURNAL_FLUSH_DELAY_MS), pdFALSE, NULL, flush_timer_cb);
+    if (!journal_lock || !flush_timer)
+    {
+        partition = NULL;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Append-only record journal in a dedicated flash partition. Appends are
+ * batched in RAM and written within JOURNAL_FLUSH_DELAY_MS, or once the
+ * batch is full, to limit flash wear */
+
+/* Types */
+typedef void (*journal_replay_cb_t)(const uint8_t *data, size_t len,
+    void *ctx);
+
+/* Calls the callback for each complete record, oldest first */
+int journal_replay(journal_replay_cb_t cb, void *ctx);
+/* Returns -1 if the journal is full, it should be cleared and rewritten */
+int journal_append(const void *data, size_t len);
+int journal_flush(void);
+int journal_clear(void);
+
+int journal_initialize(const char *partition_label);
+
+#endif
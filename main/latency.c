@@ -0,0 +1,105 @@
+#include "latency.h"
+#include "histogram.h"
+#include <cJSON.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <string.h>
+
+/* Samples are kept in two windows, the current one and the previous one, so
+ * statistics roll without ever being empty right after a rotation */
+#define LATENCY_WINDOW_US (60 * 1000 * 1000)
+
+/* Types */
+typedef struct {
+    int64_t epoch;
+    histogram_t us;
+} latency_window_t;
+
+/* Internal state */
+static latency_window_t windows[LATENCY_STAGE_MAX][2];
+static portMUX_TYPE latency_lock = portMUX_INITIALIZER_UNLOCKED;
+
+char *latency_stage_to_str(latency_stage_t stage)
+{
+    switch (stage)
+    {
+    case LATENCY_STAGE_DEQUEUE: return "Dequeue";
+    case LATENCY_STAGE_DECODE: return "Decode";
+    case LATENCY_STAGE_TX_DONE: return "TxDone";
+    case LATENCY_STAGE_PUBLISH: return "Publish";
+    case LATENCY_STAGE_MAX: break;
+    }
+
+    return "Invalid";
+}
+
+void latency_record(latency_stage_t stage, int64_t origin)
+{
+    int64_t now = esp_timer_get_time();
+    int64_t epoch = now / LATENCY_WINDOW_US + 1;
+    uint32_t us;
+    latency_window_t *window;
+
+    if (!origin || stage >= LATENCY_STAGE_MAX)
+        return;
+
+    us = now > origin ? now - origin : 0;
+    window = &windows[stage][epoch & 1];
+
+    portENTER_CRITICAL_SAFE(&latency_lock);
+    if (window->epoch != epoch)
+    {
+        memset(window, 0, sizeof(*window));
+        window->epoch = epoch;
+    }
+    histogram_add(&window->us, us);
+    portEXIT_CRITICAL_SAFE(&latency_lock);
+}
+
+void latency_stats_get(latency_stage_t stage, latency_stats_t *stats)
+{
+    int64_t epoch = esp_timer_get_time() / LATENCY_WINDOW_US + 1;
+    histogram_t us = {};
+    int i;
+
+    memset(stats, 0, sizeof(*stats));
+    if (stage >= LATENCY_STAGE_MAX)
+        return;
+
+    portENTER_CRITICAL(&latency_lock);
+    for (i = 0; i < 2; i++)
+    {
+        /* Only the current and previous windows are still relevant */
+        if (windows[stage][i].epoch >= epoch - 1)
+            histogram_merge(&us, &windows[stage][i].us);
+    }
+    portEXIT_CRITICAL(&latency_lock);
+
+    stats->count = us.count;
+    stats->min_us = us.min;
+    stats->avg_us = histogram_avg(&us);
+    stats->p99_us = histogram_percentile(&us, 99);
+    stats->max_us = us.max;
+}
+
+cJSON *latency_to_json(void)
+{
+    cJSON *latency = cJSON_CreateObject();
+    latency_stats_t stats;
+    latency_stage_t stage;
+
+    for (stage = 0; stage < LATENCY_STAGE_MAX; stage++)
+    {
+        cJSON *item = cJSON_AddObjectToObject(latency,
+            latency_stage_to_str(stage));
+
+        latency_stats_get(stage, &stats);
+        cJSON_AddNumberToObject(item, "count", stats.count);
+        cJSON_AddNumberToObject(item, "min_us", stats.min_us);
+        cJSON_AddNumberToObject(item, "avg_us", stats.avg_us);
+        cJSON_AddNumberToObject(item, "p99_us", stats.p99_us);
+        cJSON_AddNumberToObject(item, "max_us", stats.max_us);
+    }
+
+    return latency;
+}
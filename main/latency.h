@@ -0,0 +1,35 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <cJSON.h>
+#include <stdint.h>
+
+/* Stages of handling a remote's frame, each measured from the end of its
+ * capture (the RMT receive done interrupt) */
+typedef enum {
+    LATENCY_STAGE_DEQUEUE,
+    LATENCY_STAGE_DECODE,
+    LATENCY_STAGE_TX_DONE,
+    LATENCY_STAGE_PUBLISH,
+    LATENCY_STAGE_MAX,
+} latency_stage_t;
+
+typedef struct {
+    uint32_t count;
+    uint32_t min_us;
+    uint32_t avg_us;
+    uint32_t p99_us;
+    uint32_t max_us;
+} latency_stats_t;
+
+char *latency_stage_to_str(latency_stage_t stage);
+
+/* Records the time since origin, in uS since boot. Safe to call from an ISR,
+ * an origin of 0 is ignored */
+void latency_record(latency_stage_t stage, int64_t origin);
+
+/* Statistics cover the last one to two minutes */
+void latency_stats_get(latency_stage_t stage, latency_stats_t *stats);
+cJSON *latency_to_json(void);
+
+#endif
@@ -0,0 +1,103 @@
+#include "manchester_encoder.h"
+#include "protocol_parsers.h"
+#include <driver/rmt_encoder.h>
+#include <esp_log.h>
+#include <stdlib.h>
+
+static const char *TAG = "MANCHESTER_ENCODER";
+
+/* Types */
+typedef struct {
+    rmt_encoder_t base;
+    rmt_encoder_t *copy_encoder;
+    size_t index;
+    /* The copy encoder may resume from this symbol after a MEM_FULL */
+    rmt_symbol_word_t symbol;
+} manchester_encoder_t;
+
+/* Symbols are generated one at a time straight into the RMT memory, so no
+ * frame is ever materialised in RAM */
+static size_t manchester_encode(rmt_encoder_t *encoder,
+    rmt_channel_handle_t channel, const void *primary_data, size_t data_size,
+    rmt_encode_state_t *ret_state)
+{
+    manchester_encoder_t *manchester =
+        __containerof(encoder, manchester_encoder_t, base);
+    const manchester_frame_t *frame = primary_data;
+    rmt_encoder_t *copy_encoder = manchester->copy_encoder;
+    size_t len = manchester_frame_symbols(frame->protocol);
+    rmt_encode_state_t session_state = RMT_ENCODING_RESET;
+    int state = RMT_ENCODING_RESET;
+    size_t encoded_symbols = 0;
+
+    while (manchester->index < len)
+    {
+        manchester->symbol = manchester_symbol(frame->protocol, frame->value,
+            manchester->index);
+        encoded_symbols += copy_encoder->encode(copy_encoder, channel,
+            &manchester->symbol, sizeof(manchester->symbol), &session_state);
+
+        if (session_state & RMT_ENCODING_COMPLETE)
+            manchester->index++;
+
+        if (session_state & RMT_ENCODING_MEM_FULL)
+        {
+            state |= RMT_ENCODING_MEM_FULL;
+            goto out;
+        }
+    }
+
+    manchester->index = 0;
+    state |= RMT_ENCODING_COMPLETE;
+
+out:
+    *ret_state = state;
+    return encoded_symbols;
+}
+
+static esp_err_t manchester_reset(rmt_encoder_t *encoder)
+{
+    manchester_encoder_t *manchester =
+        __containerof(encoder, manchester_encoder_t, base);
+
+    rmt_encoder_reset(manchester->copy_encoder);
+    manchester->index = 0;
+
+    return ESP_OK;
+}
+
+static esp_err_t manchester_del(rmt_encoder_t *encoder)
+{
+    manchester_encoder_t *manchester =
+        __containerof(encoder, manchester_encoder_t, base);
+
+    rmt_del_encoder(manchester->copy_encoder);
+    free(manchester);
+
+    return ESP_OK;
+}
+
+int manchester_encoder_new(rmt_encoder_handle_t *encoder)
+{
+    rmt_copy_encoder_config_t copy_encoder_config = {};
+    manchester_encoder_t *manchester = calloc(1, sizeof(*manchester));
+
+    if (!manchester)
+        return -1;
+
+    manchester->base.encode = manchester_encode;
+    manchester->base.reset = manchester_reset;
+    manchester->base.del = manchester_del;
+
+    if (rmt_new_copy_encoder(&copy_encoder_config,
+        &manchester->copy_encoder) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed creating copy encoder");
+        free(manchester);
+        return -1;
+    }
+
+    *encoder = &manchester->base;
+
+    return 0;
+}
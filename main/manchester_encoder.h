@@ -0,0 +1,17 @@
+#ifndef MANCHESTER_ENCODER_H
+#define MANCHESTER_ENCODER_H
+
+#include "protocol_parsers.h"
+#include <driver/rmt_encoder.h>
+#include <stdint.h>
+
+/* Types */
+/* Payload passed to rmt_transmit(), must remain valid until it's sent */
+typedef struct {
+    const manchester_protocol_t *protocol;
+    uint64_t value;
+} manchester_frame_t;
+
+int manchester_encoder_new(rmt_encoder_handle_t *encoder);
+
+#endif
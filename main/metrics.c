@@ -0,0 +1,97 @@
+#include "metrics.h"
+#include <cJSON.h>
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+#include <esp_system.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "METRICS";
+
+/* Tasks created by the application, others belong to ESP-IDF */
+static const char *metrics_tasks[] = {
+    "ac_mitm_task",
+    "ir_task",
+    "ota_task",
+    "power_detector_task",
+    NULL
+};
+#define METRICS_TASKS (sizeof(metrics_tasks) / sizeof(*metrics_tasks) - 1)
+
+/* Internal state */
+static configRUN_TIME_COUNTER_TYPE prev_total_runtime = 0;
+static configRUN_TIME_COUNTER_TYPE prev_task_runtime[METRICS_TASKS] = {};
+static TaskHandle_t prev_task_handle[METRICS_TASKS] = {};
+
+void metrics_heap_get(metrics_heap_t *heap)
+{
+    heap->free = esp_get_free_heap_size();
+    heap->min_free = esp_get_minimum_free_heap_size();
+    heap->largest_free_block =
+        heap_caps_get_largest_free_block(MALLOC_CAP_DEFAULT);
+}
+
+static int metrics_task_index(const char *name)
+{
+    int i;
+
+    for (i = 0; metrics_tasks[i]; i++)
+    {
+        if (!strcmp(name, metrics_tasks[i]))
+            return i;
+    }
+
+    return -1;
+}
+
+cJSON *metrics_tasks_to_json(void)
+{
+    UBaseType_t count = uxTaskGetNumberOfTasks(), i;
+    TaskStatus_t *tasks = malloc(count * sizeof(*tasks));
+    configRUN_TIME_COUNTER_TYPE total_runtime, elapsed;
+    cJSON *json;
+
+    if (!tasks)
+    {
+        ESP_LOGE(TAG, "Failed allocating status of %u tasks", count);
+        return NULL;
+    }
+
+    /* Run time counters wrap around, unsigned subtraction still works */
+    count = uxTaskGetSystemState(tasks, count, &total_runtime);
+    elapsed = (total_runtime - prev_total_runtime) * portNUM_PROCESSORS;
+    prev_total_runtime = total_runtime;
+
+    json = cJSON_CreateObject();
+    for (i = 0; i < count; i++)
+    {
+        int index = metrics_task_index(tasks[i].pcTaskName);
+        configRUN_TIME_COUNTER_TYPE runtime;
+        cJSON *task;
+
+        if (index < 0)
+            continue;
+
+        /* A task that was (re)created since counts from 0, e.g. ota_task */
+        if (tasks[i].xHandle != prev_task_handle[index])
+        {
+            prev_task_handle[index] = tasks[i].xHandle;
+            prev_task_runtime[index] = 0;
+        }
+
+        runtime = tasks[i].ulRunTimeCounter - prev_task_runtime[index];
+        prev_task_runtime[index] = tasks[i].ulRunTimeCounter;
+
+        task = cJSON_AddObjectToObject(json, tasks[i].pcTaskName);
+        /* ESP-IDF reports stack sizes in bytes, not words */
+        cJSON_AddNumberToObject(task, "stack_free",
+            tasks[i].usStackHighWaterMark);
+        cJSON_AddNumberToObject(task, "cpu",
+            elapsed ? (uint64_t)runtime * 100 / elapsed : 0);
+    }
+
+    free(tasks);
+    return json;
+}
@@ -0,0 +1,20 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <cJSON.h>
+#include <stdint.h>
+
+/* Types */
+typedef struct {
+    uint32_t free;
+    uint32_t min_free;
+    uint32_t largest_free_block;
+} metrics_heap_t;
+
+void metrics_heap_get(metrics_heap_t *heap);
+
+/* Stack high water mark (in bytes) and CPU usage (in percent of all cores,
+ * since the previous call) of the application's tasks */
+cJSON *metrics_tasks_to_json(void);
+
+#endif
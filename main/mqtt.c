@@ -1,12 +1,19 @@
 #include "mqtt.h"
+#include "journal.h"
 #include "resolve.h"
 #include <esp_err.h>
 #include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
 #include <mqtt_client.h>
+#include <stdatomic.h>
 #include <string.h>
 
 /* Constants */
 static const char *TAG = "MQTT";
+/* Longest topic a received message may have, it's copied to the stack */
+#define MQTT_MAX_TOPIC_LEN 256
 
 /* Types */
 typedef struct mqtt_subscription_t {
@@ -17,6 +24,19 @@ typedef struct mqtt_subscription_t {
     mqtt_free_ctx_cb_t free_cb;
 } mqtt_subscription_t;
 
+/* Subscriptions are kept in a trie with a node per topic level, so a message
+ * is only matched against the levels it actually has. The single and multi
+ * level wildcards are kept aside so matching them doesn't cost a lookup */
+typedef struct mqtt_node_t {
+    struct mqtt_node_t *next;
+    struct mqtt_node_t *parent;
+    struct mqtt_node_t *children;
+    struct mqtt_node_t *single_level;
+    struct mqtt_node_t *multi_level;
+    mqtt_subscription_t *subscriptions;
+    char level[];
+} mqtt_node_t;
+
 typedef struct mqtt_publications_t {
     struct mqtt_publications_t *next;
     char *topic;
@@ -24,13 +44,39 @@ typedef struct mqtt_publications_t {
     size_t len;
     int qos;
     uint8_t retained;
+    /* Topic and payload, in the same allocation */
+    uint8_t data[];
 } mqtt_publications_t;
 
+/* Journal records are the header, followed by the publication's data */
+typedef struct {
+    uint8_t qos;
+    uint8_t retained;
+} __attribute__((packed)) mqtt_journal_header_t;
+
 /* Internal state */
 static esp_mqtt_client_handle_t mqtt_handle = NULL;
-static mqtt_subscription_t *subscription_list = NULL;
-static mqtt_publications_t *publications_list = NULL;
+static mqtt_node_t subscriptions = {};
+/* Publications made while disconnected, oldest first */
+static struct {
+    mqtt_publications_t *head;
+    mqtt_publications_t **tail;
+    size_t count;
+    size_t size;
+    mqtt_overflow_t overflow;
+    uint8_t persistent;
+    /* Set from the connection until the queue is empty, publications made
+     * meanwhile are queued behind it to keep their order */
+    uint8_t replaying;
+    /* Set from when the journal needs erasing until it's rewritten, appends
+     * are left for the rewrite */
+    uint8_t journal_clearing;
+    mqtt_offline_stats_t stats;
+} offline_queue = { .tail = &offline_queue.head };
+static SemaphoreHandle_t offline_lock = NULL;
+static TaskHandle_t journal_task = NULL;
 static uint8_t is_connected = 0;
+static atomic_uint publish_failures = 0;
 
 /* Callback functions */
 static mqtt_on_connected_cb_t on_connected_cb = NULL;
@@ -46,21 +92,86 @@ void mqtt_set_on_disconnected_cb(mqtt_on_disconnected_cb_t cb)
     on_disconnected_cb = cb;
 }
 
-static mqtt_subscription_t *mqtt_subscription_add(mqtt_subscription_t **list,
+static mqtt_node_t **mqtt_node_slot(mqtt_node_t *node, const char *level,
+    size_t len)
+{
+    mqtt_node_t **cur;
+
+    if (len == 1 && *level == '+')
+        return &node->single_level;
+    if (len == 1 && *level == '#')
+        return &node->multi_level;
+
+    for (cur = &node->children; *cur; cur = &(*cur)->next)
+    {
+        if (!strncmp((*cur)->level, level, len) && !(*cur)->level[len])
+            break;
+    }
+
+    return cur;
+}
+
+/* Returns the node of the topic, created along with its parents if needed */
+static mqtt_node_t *mqtt_node_get(mqtt_node_t *node, const char *topic,
+    uint8_t create)
+{
+    const char *level = topic, *sep;
+    mqtt_node_t **slot;
+    size_t len;
+
+    do
+    {
+        sep = strchr(level, '/');
+        len = sep ? sep - level : strlen(level);
+        slot = mqtt_node_slot(node, level, len);
+
+        if (!*slot)
+        {
+            if (!create || !(*slot = calloc(1, sizeof(**slot) + len + 1)))
+                return NULL;
+            memcpy((*slot)->level, level, len);
+            (*slot)->parent = node;
+        }
+
+        node = *slot;
+        level = sep + 1;
+    } while (sep);
+
+    return node;
+}
+
+/* Frees nodes left without subscriptions or children, up to the root */
+static void mqtt_node_prune(mqtt_node_t *node)
+{
+    mqtt_node_t *parent, **slot;
+
+    while ((parent = node->parent) && !node->subscriptions &&
+        !node->children && !node->single_level && !node->multi_level)
+    {
+        slot = mqtt_node_slot(parent, node->level, strlen(node->level));
+        *slot = node->next;
+        free(node);
+        node = parent;
+    }
+}
+
+static mqtt_subscription_t *mqtt_subscription_add(mqtt_node_t *root,
     const char *topic, mqtt_on_message_received_cb_t cb, void *ctx,
     mqtt_free_ctx_cb_t free_cb)
 {
-    mqtt_subscription_t *sub, **cur;
+    mqtt_node_t *node = mqtt_node_get(root, topic, 1);
+    mqtt_subscription_t *sub;
+
+    if (!node || !(sub = malloc(sizeof(*sub))))
+        return NULL;
 
-    sub = malloc(sizeof(*sub));
-    sub->next = NULL;
     sub->topic = strdup(topic);
     sub->cb = cb;
     sub->ctx = ctx;
     sub->free_cb = free_cb;
 
-    for (cur = list; *cur; cur = &(*cur)->next);
-    *cur = sub;
+    sub->next = node->subscriptions;
+    node->subscriptions = sub;
 
     return sub;
 }
@@ -73,88 +184,352 @@ static void mqtt_subscription_free(mqtt_subscription_t *mqtt_subscription)
     free(mqtt_subscription);
 }
 
-static void mqtt_subscriptions_free(mqtt_subscription_t **list)
+/* Removes all subscriptions whose topic starts with the prefix, returns
+ * whether the node is now empty and can be freed */
+static int mqtt_subscriptions_remove_prefix(mqtt_node_t *node,
+    const char *prefix, uint8_t unsubscribe)
 {
-    mqtt_subscription_t *cur, **head = list;
+    mqtt_node_t **children[] = {
+        &node->children, &node->single_level, &node->multi_level, NULL
+    };
+    mqtt_node_t ***list, **cur, *tmp;
+    mqtt_subscription_t **sub, *sub_tmp;
+    size_t prefix_len = strlen(prefix);
+
+    for (sub = &node->subscriptions; *sub;)
+    {
+        if (strncmp(prefix, (*sub)->topic, prefix_len))
+        {
+            sub = &(*sub)->next;
+            continue;
+        }
+        sub_tmp = *sub;
+        *sub = sub_tmp->next;
+
+        ESP_LOGD(TAG, "Unsubscribing from %s", sub_tmp->topic);
+        if (unsubscribe)
+            esp_mqtt_client_unsubscribe(mqtt_handle, sub_tmp->topic);
+        mqtt_subscription_free(sub_tmp);
+    }
 
-    while (*list)
+    for (list = children; *list; list++)
     {
-        cur = *list;
-        *list = cur->next;
-        mqtt_subscription_free(cur);
+        for (cur = *list; *cur;)
+        {
+            if (!mqtt_subscriptions_remove_prefix(*cur, prefix, unsubscribe))
+            {
+                cur = &(*cur)->next;
+                continue;
+            }
+            tmp = *cur;
+            *cur = tmp->next;
+            free(tmp);
+        }
     }
-    *head = NULL;
+
+    return !node->subscriptions && !node->children && !node->single_level &&
+        !node->multi_level;
 }
 
-static void mqtt_subscription_remove(mqtt_subscription_t **list,
-    const char *topic)
+static void mqtt_subscriptions_free(mqtt_node_t *root)
 {
-    mqtt_subscription_t **cur, *tmp;
+    mqtt_subscriptions_remove_prefix(root, "", 0);
+}
 
-    for (cur = list; *cur; cur = &(*cur)->next)
-    {
-        if (!strcmp((*cur)->topic, topic))
-            break;
-    }
+static void mqtt_subscription_remove(mqtt_node_t *root, const char *topic)
+{
+    mqtt_node_t *node = mqtt_node_get(root, topic, 0);
+    mqtt_subscription_t *tmp;
 
-    if (!*cur)
+    if (!node || !node->subscriptions)
         return;
 
-    tmp = *cur;
-    *cur = (*cur)->next;
+    tmp = node->subscriptions;
+    node->subscriptions = tmp->next;
     mqtt_subscription_free(tmp);
+    mqtt_node_prune(node);
+}
+
+static void mqtt_node_notify(mqtt_node_t *node, const char *topic,
+    uint8_t *payload, size_t len)
+{
+    mqtt_subscription_t *cur;
+
+    for (cur = node->subscriptions; cur; cur = cur->next)
+        cur->cb(topic, payload, len, cur->ctx);
 }
 
-static mqtt_publications_t *mqtt_publication_add(mqtt_publications_t **list,
-    const char *topic, uint8_t *payload, size_t len, int qos, uint8_t retained)
+/* Level is the rest of the topic to match below node, or NULL once it was
+ * fully matched. Wildcards don't match topics starting with '$' */
+static void mqtt_node_match(mqtt_node_t *node, const char *topic,
+    const char *level, uint8_t *payload, size_t len)
 {
-    mqtt_publications_t *pub = malloc(sizeof(*pub));
+    uint8_t wildcards = level && (node->parent || *level != '$');
+    const char *sep, *next;
+    mqtt_node_t **slot;
+
+    /* A multi level wildcard also matches its parent level */
+    if (node->multi_level && (!level || wildcards))
+        mqtt_node_notify(node->multi_level, topic, payload, len);
 
-    pub->topic = strdup(topic);
-    pub->payload = malloc(len);
+    if (!level)
+    {
+        mqtt_node_notify(node, topic, payload, len);
+        return;
+    }
+
+    sep = strchr(level, '/');
+    next = sep ? sep + 1 : NULL;
+
+    if (node->single_level && wildcards)
+        mqtt_node_match(node->single_level, topic, next, payload, len);
+
+    slot = mqtt_node_slot(node, level, sep ? sep - level : strlen(level));
+    if (*slot && slot != &node->single_level && slot != &node->multi_level)
+        mqtt_node_match(*slot, topic, next, payload, len);
+}
+
+static mqtt_publications_t *mqtt_publication_new(const char *topic,
+    uint8_t *payload, size_t len, int qos, uint8_t retained)
+{
+    size_t topic_len = strlen(topic) + 1;
+    mqtt_publications_t *pub = malloc(sizeof(*pub) + topic_len + len);
+
+    if (!pub)
+        return NULL;
+
+    pub->next = NULL;
+    pub->topic = (char *)pub->data;
+    memcpy(pub->topic, topic, topic_len);
+    pub->payload = pub->data + topic_len;
     memcpy(pub->payload, payload, len);
     pub->len = len;
     pub->qos = qos;
     pub->retained = retained;
 
-    pub->next = *list;
-    *list = pub;
+    return pub;
+}
+
+/* The following must be called with offline_lock held */
+static void mqtt_offline_queue_unlink(mqtt_publications_t **cur)
+{
+    mqtt_publications_t *pub = *cur;
+
+    *cur = pub->next;
+    if (offline_queue.tail == &pub->next)
+        offline_queue.tail = cur;
+    offline_queue.count--;
+    free(pub);
+}
+
+static mqtt_publications_t *mqtt_offline_queue_add(const char *topic,
+    uint8_t *payload, size_t len, int qos, uint8_t retained)
+{
+    mqtt_publications_t **cur, *pub;
+
+    ESP_LOGD(TAG, "MQTT is disconnected, adding publication to queue...");
+
+    /* Only the latest value of a retained topic matters, it takes its place
+     * at the end of the queue */
+    for (cur = &offline_queue.head; retained && *cur; cur = &(*cur)->next)
+    {
+        if ((*cur)->retained && !strcmp((*cur)->topic, topic))
+        {
+            mqtt_offline_queue_unlink(cur);
+            offline_queue.stats.replaced++;
+            break;
+        }
+    }
+
+    if (offline_queue.count >= offline_queue.size)
+    {
+        offline_queue.stats.dropped++;
+        if (offline_queue.overflow == MQTT_OVERFLOW_DROP_NEWEST ||
+            !offline_queue.head)
+        {
+            ESP_LOGW(TAG, "Offline queue is full, dropping %s", topic);
+            return NULL;
+        }
+
+        ESP_LOGW(TAG, "Offline queue is full, dropping %s",
+            offline_queue.head->topic);
+        mqtt_offline_queue_unlink(&offline_queue.head);
+    }
+
+    if (!(pub = mqtt_publication_new(topic, payload, len, qos, retained)))
+    {
+        ESP_LOGE(TAG, "Failed queuing publication to %s", topic);
+        offline_queue.stats.dropped++;
+        return NULL;
+    }
+
+    *offline_queue.tail = pub;
+    offline_queue.tail = &pub->next;
+    offline_queue.count++;
 
     return pub;
 }
 
-static void mqtt_publication_free(mqtt_publications_t *mqtt_publication)
+static int mqtt_offline_journal_write(mqtt_publications_t *pub)
 {
-    free(mqtt_publication->topic);
-    free(mqtt_publication->payload);
-    free(mqtt_publication);
+    size_t len = pub->payload - pub->data + pub->len;
+    mqtt_journal_header_t *header = malloc(sizeof(*header) + len);
+    int ret;
+
+    if (!header)
+        return -1;
+
+    header->qos = pub->qos;
+    header->retained = pub->retained;
+    memcpy(header + 1, pub->data, len);
+    ret = journal_append(header, sizeof(*header) + len);
+
+    free(header);
+    return ret;
 }
 
-static void mqtt_publications_free(mqtt_publications_t **list)
+static void mqtt_offline_journal_write_queue(void)
 {
-    mqtt_publications_t *cur, **head = list;
+    mqtt_publications_t *pub;
 
-    while (*list)
+    for (pub = offline_queue.head; pub; pub = pub->next)
     {
-        cur = *list;
-        *list = cur->next;
-        mqtt_publication_free(cur);
+        if (mqtt_offline_journal_write(pub))
+        {
+            ESP_LOGE(TAG, "Failed journaling publication to %s", pub->topic);
+            return;
+        }
     }
-    *head = NULL;
 }
 
-static void mqtt_publications_publish(mqtt_publications_t *list)
+/* Compacts the journal down to the publications still queued */
+static void mqtt_offline_journal_rewrite(void)
+{
+    if (journal_clear())
+        return;
+
+    mqtt_offline_journal_write_queue();
+}
+
+/* Erasing flash takes too long for the client's event handler or for holding
+ * offline_lock, so it's left to the journal task. Must be called with
+ * offline_lock held */
+static void mqtt_offline_journal_compact(void)
 {
-    for (; list; list = list->next)
+    if (offline_queue.journal_clearing)
+        return;
+
+    offline_queue.journal_clearing = 1;
+    xTaskNotifyGive(journal_task);
+}
+
+static void mqtt_offline_journal_append(mqtt_publications_t *pub)
+{
+    if (offline_queue.journal_clearing)
+        return;
+
+    /* The journal also keeps the publications that were since replaced or
+     * dropped from the queue, so once full it's compacted */
+    if (mqtt_offline_journal_write(pub))
+        mqtt_offline_journal_compact();
+}
+
+static void mqtt_offline_journal_replay_cb(const uint8_t *data, size_t len,
+    void *ctx)
+{
+    const mqtt_journal_header_t *header = (const void *)data;
+    const char *topic = (const char *)(header + 1);
+    size_t topic_len;
+
+    if (len < sizeof(*header) || !memchr(topic, '\0', len - sizeof(*header)))
+        return;
+
+    topic_len = strlen(topic) + 1;
+    mqtt_offline_queue_add(topic, (uint8_t *)topic + topic_len,
+        len - sizeof(*header) - topic_len, header->qos, header->retained);
+}
+
+static int mqtt_client_publish(const char *topic, uint8_t *payload,
+    size_t len, int qos, uint8_t retained)
+{
+    if (esp_mqtt_client_publish(mqtt_handle, (char *)topic, (char *)payload,
+        len, qos, retained) < 0)
+    {
+        atomic_fetch_add(&publish_failures, 1);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* The client holds its own lock while calling the event handler, so it's
+ * never called with offline_lock held. Instead, the queue is detached under
+ * the lock and published without it, until it stays empty */
+static void mqtt_offline_queue_publish(void)
+{
+    mqtt_publications_t *pub, *next;
+    uint32_t replayed = 0;
+
+    while (1)
     {
-        ESP_LOGI(TAG, "Publishing from queue: %s = %.*s", list->topic,
-            list->len, list->payload);
+        xSemaphoreTake(offline_lock, portMAX_DELAY);
+        offline_queue.stats.replayed += replayed;
+        if (!is_connected || !(pub = offline_queue.head))
+        {
+            offline_queue.replaying = 0;
+            xSemaphoreGive(offline_lock);
+            return;
+        }
+        offline_queue.head = NULL;
+        offline_queue.tail = &offline_queue.head;
+        offline_queue.count = 0;
+        xSemaphoreGive(offline_lock);
 
-        mqtt_publish(list->topic, list->payload, list->len, list->qos,
-            list->retained);
+        for (replayed = 0; pub; pub = next, replayed++)
+        {
+            ESP_LOGI(TAG, "Publishing from queue: %s = %.*s", pub->topic,
+                pub->len, pub->payload);
+
+            mqtt_client_publish(pub->topic, pub->payload, pub->len, pub->qos,
+                pub->retained);
+            next = pub->next;
+            free(pub);
+        }
     }
 }
 
+/* A low priority task of its own, so erasing the journal doesn't hold up the
+ * client, the publishers or the timer task */
+static void mqtt_journal_task(void *pvParameter)
+{
+    while (1)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        journal_clear();
+
+        /* The publications still queued, including those made meanwhile */
+        xSemaphoreTake(offline_lock, portMAX_DELAY);
+        offline_queue.journal_clearing = 0;
+        mqtt_offline_journal_write_queue();
+        xSemaphoreGive(offline_lock);
+    }
+
+    vTaskDelete(NULL);
+}
+
+int mqtt_offline_queue_sync(void)
+{
+    return offline_queue.persistent ? journal_flush() : 0;
+}
+
+void mqtt_offline_stats_get(mqtt_offline_stats_t *stats)
+{
+    xSemaphoreTake(offline_lock, portMAX_DELAY);
+    *stats = offline_queue.stats;
+    stats->queued = offline_queue.count;
+    xSemaphoreGive(offline_lock);
+}
+
 int mqtt_subscribe(const char *topic, int qos, mqtt_on_message_received_cb_t cb,
     void *ctx, mqtt_free_ctx_cb_t free_cb)
 {
@@ -168,32 +543,21 @@ int mqtt_subscribe(const char *topic, int qos, mqtt_on_message_received_cb_t cb,
         return -1;
     }
 
-    mqtt_subscription_add(&subscription_list, topic, cb, ctx, free_cb);
+    if (!mqtt_subscription_add(&subscriptions, topic, cb, ctx, free_cb))
+    {
+        ESP_LOGE(TAG, "Failed adding subscription to %s", topic);
+        esp_mqtt_client_unsubscribe(mqtt_handle, topic);
+        return -1;
+    }
+
     return 0;
 }
 
 int mqtt_unsubscribe_topic_prefix(const char *topic_prefix)
 {
-    mqtt_subscription_t *tmp, **cur = &subscription_list;
-    size_t prefix_len = strlen(topic_prefix);
-
     ESP_LOGD(TAG, "Unsubscribing topics with %s prefix", topic_prefix);
-
-    while (*cur)
-    {
-        tmp = *cur;
-        if (strncmp(topic_prefix, (*cur)->topic, prefix_len))
-        {
-            cur = &(*cur)->next;
-            continue;
-        }
-        *cur = (*cur)->next;
-
-        ESP_LOGD(TAG, "Unsubscribing from %s", tmp->topic);
-        if (is_connected)
-            esp_mqtt_client_unsubscribe(mqtt_handle, tmp->topic);
-        mqtt_subscription_free(tmp);
-    }
+    mqtt_subscriptions_remove_prefix(&subscriptions, topic_prefix,
+        is_connected);
 
     return 0;
 }
@@ -201,7 +565,7 @@ int mqtt_unsubscribe_topic_prefix(const char *topic_prefix)
 int mqtt_unsubscribe(const char *topic)
 {
     ESP_LOGD(TAG, "Unsubscribing from %s", topic);
-    mqtt_subscription_remove(&subscription_list, topic);
+    mqtt_subscription_remove(&subscriptions, topic);
 
     if (!is_connected)
         return 0;
@@ -212,39 +576,52 @@ int mqtt_unsubscribe(const char *topic)
 int mqtt_publish(const char *topic, uint8_t *payload, size_t len, int qos,
     uint8_t retained)
 {
-    if (is_connected)
+    mqtt_publications_t *pub;
+    uint8_t direct;
+
+    /* The connection state can't change until the publication is queued,
+     * otherwise it could miss the flush on reconnection */
+    xSemaphoreTake(offline_lock, portMAX_DELAY);
+    if (!(direct = is_connected && !offline_queue.replaying) &&
+        (pub = mqtt_offline_queue_add(topic, payload, len, qos, retained)) &&
+        offline_queue.persistent)
     {
-        return esp_mqtt_client_publish(mqtt_handle, (char *)topic,
-            (char *)payload, len, qos, retained) < 0;
+        mqtt_offline_journal_append(pub);
     }
+    xSemaphoreGive(offline_lock);
 
-    /* If we're currently not connected, queue publication */
-    ESP_LOGD(TAG, "MQTT is disconnected, adding publication to queue...");
-    mqtt_publication_add(&publications_list, topic, payload, len, qos,
-        retained);
+    if (!direct)
+        return 0;
 
-    return 0;
+    return mqtt_client_publish(topic, payload, len, qos, retained);
+}
+
+uint32_t mqtt_publish_failures_get(void)
+{
+    return atomic_load(&publish_failures);
 }
 
 static void mqtt_message_cb(const char *topic, size_t topic_len,
     uint8_t *payload, size_t len)
 {
-    mqtt_subscription_t *cur;
+    char buf[MQTT_MAX_TOPIC_LEN + 1];
 
     ESP_LOGD(TAG, "Received: %.*s => %.*s (%d)\n", topic_len, topic, len,
         payload, (int)len);
 
-    for (cur = subscription_list; cur; cur = cur->next)
+    if (topic_len > MQTT_MAX_TOPIC_LEN)
     {
-        /* TODO: Correctly match MQTT topics (i.e. support wildcards) */
-        if (strncmp(cur->topic, topic, topic_len) ||
-            cur->topic[topic_len] != '\0')
-        {
-            continue;
-        }
-
-        cur->cb(cur->topic, payload, len, cur->ctx);
+        ESP_LOGW(TAG, "Ignoring message, topic longer than %d bytes: %.*s",
+            MQTT_MAX_TOPIC_LEN, MQTT_MAX_TOPIC_LEN, topic);
+        return;
     }
+
+    /* Subscribers get the topic the message was published to, which may
+     * differ from the one they subscribed to when using wildcards */
+    memcpy(buf, topic, topic_len);
+    buf[topic_len] = '\0';
+
+    mqtt_node_match(&subscriptions, buf, buf, payload, len);
 }
 
 static void mqtt_event_cb(void *handler_args, esp_event_base_t base,
@@ -255,16 +632,26 @@ static void mqtt_event_cb(void *handler_args, esp_event_base_t base,
     switch ((esp_mqtt_event_id_t)event_id) {
     case MQTT_EVENT_CONNECTED:
         ESP_LOGI(TAG, "MQTT client connected");
+        xSemaphoreTake(offline_lock, portMAX_DELAY);
         is_connected = 1;
-        mqtt_publications_publish(publications_list);
-        mqtt_publications_free(&publications_list);
+        offline_queue.replaying = 1;
+        xSemaphoreGive(offline_lock);
+        mqtt_offline_queue_publish();
+        if (offline_queue.persistent)
+        {
+            xSemaphoreTake(offline_lock, portMAX_DELAY);
+            mqtt_offline_journal_compact();
+            xSemaphoreGive(offline_lock);
+        }
         if (on_connected_cb)
             on_connected_cb();
         break;
     case MQTT_EVENT_DISCONNECTED:
         ESP_LOGI(TAG, "MQTT client disconnected");
+        xSemaphoreTake(offline_lock, portMAX_DELAY);
         is_connected = 0;
-        mqtt_subscriptions_free(&subscription_list);
+        xSemaphoreGive(offline_lock);
+        mqtt_subscriptions_free(&subscriptions);
         if (on_disconnected_cb)
             on_disconnected_cb();
         break;
@@ -328,8 +715,10 @@ int mqtt_connect(const char *host, uint16_t port, const char *client_id,
 int mqtt_disconnect(void)
 {
     ESP_LOGI(TAG, "Disconnecting MQTT client");
+    xSemaphoreTake(offline_lock, portMAX_DELAY);
     is_connected = 0;
-    mqtt_subscriptions_free(&subscription_list);
+    xSemaphoreGive(offline_lock);
+    mqtt_subscriptions_free(&subscriptions);
     if (mqtt_handle)
         esp_mqtt_client_destroy(mqtt_handle);
     mqtt_handle = NULL;
@@ -342,8 +731,29 @@ uint8_t mqtt_is_connected(void)
     return is_connected;
 }
 
-int mqtt_initialize(void)
+int mqtt_initialize(size_t offline_queue_size, mqtt_overflow_t overflow,
+    uint8_t persistent)
 {
     ESP_LOGD(TAG, "Initializing MQTT client");
+
+    if (!(offline_lock = xSemaphoreCreateMutex()))
+        return -1;
+
+    offline_queue.size = offline_queue_size;
+    offline_queue.overflow = overflow;
+
+    /* Publications queued before a reboot are published once connected */
+    if (persistent && !journal_initialize("journal") &&
+        xTaskCreate(mqtt_journal_task, "mqtt_journal", 3072, NULL,
+        tskIDLE_PRIORITY + 1, &journal_task) == pdPASS)
+    {
+        offline_queue.persistent = 1;
+        journal_replay(mqtt_offline_journal_replay_cb, NULL);
+        mqtt_offline_journal_rewrite();
+        memset(&offline_queue.stats, 0, sizeof(offline_queue.stats));
+        ESP_LOGI(TAG, "Restored %zu queued publications",
+            offline_queue.count);
+    }
+
     return 0;
 }
@@ -4,6 +4,21 @@
 #include <stddef.h>
 #include <stdint.h>
 
+/* Types */
+/* What to drop when a publication is made while disconnected, and the queue
+ * is full */
+typedef enum {
+    MQTT_OVERFLOW_DROP_OLDEST,
+    MQTT_OVERFLOW_DROP_NEWEST,
+} mqtt_overflow_t;
+
+typedef struct {
+    uint32_t queued;
+    uint32_t replaced;
+    uint32_t dropped;
+    uint32_t replayed;
+} mqtt_offline_stats_t;
+
 /* Event callback types */
 typedef void (*mqtt_on_connected_cb_t)(void);
 typedef void (*mqtt_on_disconnected_cb_t)(void);
@@ -22,6 +37,10 @@ int mqtt_unsubscribe_topic_prefix(const char *topic_prefix);
 int mqtt_unsubscribe(const char *topic);
 int mqtt_publish(const char *topic, uint8_t *payload, size_t len, int qos,
     uint8_t retained);
+uint32_t mqtt_publish_failures_get(void);
+void mqtt_offline_stats_get(mqtt_offline_stats_t *stats);
+/* Writes the publications queued so far to flash, e.g. before a reboot */
+int mqtt_offline_queue_sync(void);
 
 int mqtt_connect(const char *host, uint16_t port, const char *client_id,
     const char *username, const char *password, uint8_t ssl,
@@ -32,6 +51,10 @@ int mqtt_disconnect(void);
 
 uint8_t mqtt_is_connected(void);
 
-int mqtt_initialize(void);
+/* Publications made while disconnected are queued, up to the given size.
+ * Only the latest value of a retained topic is kept. A persistent queue is
+ * journaled to flash and survives reboots */
+int mqtt_initialize(size_t offline_queue_size, mqtt_overflow_t overflow,
+    uint8_t persistent);
 
 #endif
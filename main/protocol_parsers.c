@@ -1,197 +1,625 @@
 #include "protocol_parsers.h"
-#include "hal/rmt_types.h"
 #include <driver/rmt_types.h>
 #include <esp_log.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 static const char *TAG = "PROTOCOL_PARSER";
-static const uint16_t TIMING_TOLERANCE_PERCENT = 25;
+static const uint8_t TIMING_TOLERANCE_PERCENT = 25;
 
-static bool is_within_tolerance(uint16_t value, uint16_t expected)
+/* Adaptive timing, windows must not overlap so the tolerance stays below 33% */
+#define ADAPTIVE_EWMA_SHIFT 3 /* Each frame moves the estimate by 1/8 */
+#define ADAPTIVE_EVALUATION_FRAMES 16
+#define ADAPTIVE_MAX_FAILURE_PERCENT 10
+#define ADAPTIVE_WIDEN_STEP 2
+#define ADAPTIVE_MIN_TOLERANCE 10
+#define ADAPTIVE_MAX_TOLERANCE 30
+#define ADAPTIVE_MAX_DRIFT_PERCENT 10
+
+/* Repeats considered when voting on a frame's value */
+#define MANCHESTER_MAX_REPEATS 8
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+typedef enum {
+    DURATION_INVALID,
+    DURATION_HALF,
+    DURATION_FULL,
+} duration_t;
+
+/* A single frame's parsing state */
+typedef struct {
+    uint16_t backlog_length;
+    uint16_t backlog_level;
+    uint64_t value;
+    uint8_t bits;
+    uint16_t header_mark;
+    uint16_t header_space;
+    uint32_t halves_duration;
+    uint16_t halves;
+} manchester_parse_t;
+
+static timing_window_t timing_window(uint16_t expected, uint8_t tolerance)
 {
-    uint16_t lowerLimit = expected * (1 - (TIMING_TOLERANCE_PERCENT / 100.0));
-    uint16_t upperLimit = expected * (1 + (TIMING_TOLERANCE_PERCENT / 100.0));
-    bool match = lowerLimit <= value && value <= upperLimit;
+    timing_window_t window = {
+        .lo = (uint32_t)expected * (100 - tolerance) / 100,
+        .hi = (uint32_t)expected * (100 + tolerance) / 100,
+    };
 
-    ESP_LOGD(TAG, "Checking %" PRId16 " <= %" PRId16 " <= % " PRId16 " -> %d",
-        lowerLimit, value, upperLimit, match);
+    return window;
+}
 
-    return match;
+static inline bool is_within_window(uint16_t value, timing_window_t window)
+{
+    return window.lo <= value && value <= window.hi;
 }
 
-static int parse_manchester_data(rmt_symbol_word_t *symbols, size_t len,
-    uint16_t half_period, uint16_t *backlog_length, uint16_t *backlog_level,
-        uint64_t *parsed_value)
+static void manchester_windows_build(manchester_protocol_t *protocol,
+    uint16_t header_mark, uint16_t header_space, uint16_t half_period,
+    uint8_t tolerance)
 {
+    protocol->windows.header_mark = timing_window(header_mark, tolerance);
+    protocol->windows.header_space = timing_window(header_space, tolerance);
+    protocol->windows.header_space_ext =
+        timing_window(header_space + half_period, tolerance);
+    protocol->windows.half = timing_window(half_period, tolerance);
+    protocol->windows.full = timing_window(half_period * 2, tolerance);
+    protocol->windows.header_space_centre = header_space;
+    protocol->windows.half_period_centre = half_period;
+
+    ESP_LOGD(TAG, "Half period window: [%" PRIu16 ", %" PRIu16 "], full "
+        "period window: [%" PRIu16 ", %" PRIu16 "]", protocol->windows.half.lo,
+        protocol->windows.half.hi, protocol->windows.full.lo,
+        protocol->windows.full.hi);
+}
+
+static void manchester_adaptive_windows_build(manchester_protocol_t *protocol)
+{
+    manchester_windows_build(protocol,
+        protocol->adaptive.header_mark >> MANCHESTER_ADAPTIVE_FRACTION_BITS,
+        protocol->adaptive.header_space >> MANCHESTER_ADAPTIVE_FRACTION_BITS,
+        protocol->adaptive.half_period >> MANCHESTER_ADAPTIVE_FRACTION_BITS,
+        protocol->adaptive.tolerance);
+}
+
+void manchester_protocol_init(manchester_protocol_t *protocol)
+{
+    uint8_t tolerance = protocol->tolerance ? : TIMING_TOLERANCE_PERCENT;
+
+    protocol->initialized = 1;
+
+    if (!protocol->adaptive.enabled)
+    {
+        manchester_windows_build(protocol, protocol->header_mark,
+            protocol->header_space, protocol->half_period, tolerance);
+        return;
+    }
+
+    /* Estimates start at the nominal timing */
+    if (!protocol->adaptive.half_period)
+    {
+        protocol->adaptive.tolerance = tolerance;
+        protocol->adaptive.header_mark =
+            protocol->header_mark << MANCHESTER_ADAPTIVE_FRACTION_BITS;
+        protocol->adaptive.header_space =
+            protocol->header_space << MANCHESTER_ADAPTIVE_FRACTION_BITS;
+        protocol->adaptive.half_period =
+            protocol->half_period << MANCHESTER_ADAPTIVE_FRACTION_BITS;
+    }
+    manchester_adaptive_windows_build(protocol);
+}
+
+void manchester_protocol_header_bounds(const manchester_protocol_t *protocol,
+    timing_window_t *header_mark, timing_window_t *header_space)
+{
+    uint8_t tolerance = protocol->tolerance ? : TIMING_TOLERANCE_PERCENT;
+
+    if (protocol->adaptive.enabled)
+        tolerance = ADAPTIVE_MAX_TOLERANCE + ADAPTIVE_MAX_DRIFT_PERCENT;
+
+    *header_mark = timing_window(protocol->header_mark, tolerance);
+    /* The header space may absorb the first half period */
+    header_space->lo = timing_window(protocol->header_space, tolerance).lo;
+    header_space->hi = timing_window(protocol->header_space +
+        protocol->half_period, tolerance).hi;
+}
+
+/* Moves an estimate towards a sample, without drifting too far from the
+ * nominal timing */
+static uint32_t adaptive_estimate(uint32_t estimate, uint16_t sample,
+    uint16_t nominal)
+{
+    int32_t delta = ((int32_t)sample << MANCHESTER_ADAPTIVE_FRACTION_BITS) -
+        (int32_t)estimate;
+    uint32_t lo = ((uint32_t)nominal << MANCHESTER_ADAPTIVE_FRACTION_BITS) *
+        (100 - ADAPTIVE_MAX_DRIFT_PERCENT) / 100;
+    uint32_t hi = ((uint32_t)nominal << MANCHESTER_ADAPTIVE_FRACTION_BITS) *
+        (100 + ADAPTIVE_MAX_DRIFT_PERCENT) / 100;
+
+    estimate += delta / (1 << ADAPTIVE_EWMA_SHIFT);
+    if (estimate < lo)
+        return lo;
+    if (estimate > hi)
+        return hi;
+    return estimate;
+}
+
+static void manchester_adapt(manchester_protocol_t *protocol, bool decoded,
+    uint16_t header_mark, uint16_t header_space, uint16_t half_period)
+{
+    if (!protocol->adaptive.enabled)
+        return;
+
+    if (decoded)
+    {
+        protocol->adaptive.decoded++;
+        protocol->adaptive.header_mark = adaptive_estimate(
+            protocol->adaptive.header_mark, header_mark,
+            protocol->header_mark);
+        protocol->adaptive.header_space = adaptive_estimate(
+            protocol->adaptive.header_space, header_space,
+            protocol->header_space);
+        protocol->adaptive.half_period = adaptive_estimate(
+            protocol->adaptive.half_period, half_period,
+            protocol->half_period);
+    }
+    else
+        protocol->adaptive.failed++;
+
+    /* Widen the windows when failures rise, narrow them while there are none
+     * to reject more noise */
+    if (protocol->adaptive.decoded + protocol->adaptive.failed >=
+        ADAPTIVE_EVALUATION_FRAMES)
+    {
+        if (protocol->adaptive.failed * 100 >
+            ADAPTIVE_EVALUATION_FRAMES * ADAPTIVE_MAX_FAILURE_PERCENT)
+        {
+            protocol->adaptive.tolerance = MIN(protocol->adaptive.tolerance +
+                ADAPTIVE_WIDEN_STEP, ADAPTIVE_MAX_TOLERANCE);
+        }
+        else if (!protocol->adaptive.failed &&
+            protocol->adaptive.tolerance > ADAPTIVE_MIN_TOLERANCE)
+        {
+            protocol->adaptive.tolerance--;
+        }
+
+        ESP_LOGD(TAG, "Adaptive tolerance: %u%% (%u/%u frames failed)",
+            protocol->adaptive.tolerance, protocol->adaptive.failed,
+            ADAPTIVE_EVALUATION_FRAMES);
+        protocol->adaptive.decoded = protocol->adaptive.failed = 0;
+    }
+
+    manchester_adaptive_windows_build(protocol);
+}
+
+void pulse_protocol_init(pulse_protocol_t *protocol)
+{
+    protocol->windows.header_mark =
+        timing_window(protocol->header_mark, TIMING_TOLERANCE_PERCENT);
+    protocol->windows.header_space =
+        timing_window(protocol->header_space, TIMING_TOLERANCE_PERCENT);
+    protocol->windows.zero_mark =
+        timing_window(protocol->zero_mark, TIMING_TOLERANCE_PERCENT);
+    protocol->windows.zero_space =
+        timing_window(protocol->zero_space, TIMING_TOLERANCE_PERCENT);
+    protocol->windows.one_mark =
+        timing_window(protocol->one_mark, TIMING_TOLERANCE_PERCENT);
+    protocol->windows.one_space =
+        timing_window(protocol->one_space, TIMING_TOLERANCE_PERCENT);
+    protocol->initialized = 1;
+}
+
+/* Windows don't overlap as long as the tolerance is below 33%, so a single
+ * ascending compare chain is enough to classify a duration */
+static inline duration_t classify_duration(
+    const manchester_protocol_t *protocol, uint16_t duration)
+{
+    if (duration < protocol->windows.half.lo)
+        return DURATION_INVALID;
+    if (duration <= protocol->windows.half.hi)
+        return DURATION_HALF;
+    if (duration < protocol->windows.full.lo)
+        return DURATION_INVALID;
+    if (duration <= protocol->windows.full.hi)
+        return DURATION_FULL;
+    return DURATION_INVALID;
+}
+
+static int parse_manchester_data(const manchester_protocol_t *protocol,
+    rmt_symbol_word_t *symbols, size_t len, manchester_parse_t *parse)
+{
+    uint16_t half_period = protocol->half_period;
+    duration_t low, high;
     int i;
 
     for (i = 0; i < len; i++)
     {
         ESP_LOGD(TAG, "Handling {%d: %d},{%d: %d}, backlog {%d: %d}",
             symbols[i].level0, symbols[i].duration0, symbols[i].level1,
-            symbols[i].duration1, *backlog_level, *backlog_length);
-
-        bool is_low_with_backlog = false;
-        bool is_high_with_backlog = false;
+            symbols[i].duration1, parse->backlog_level, parse->backlog_length);
 
         /* Low value */
-        if (is_within_tolerance(symbols[i].duration0, half_period * 2))
-            is_low_with_backlog = true;
-        else if (!is_within_tolerance(symbols[i].duration0, half_period))
+        if ((low = classify_duration(protocol, symbols[i].duration0)) ==
+            DURATION_INVALID)
         {
             ESP_LOGD(TAG, "Found invalid low value: %" PRId16,
                 symbols[i].duration0);
             return i;
         }
+        parse->halves_duration += symbols[i].duration0;
+        parse->halves += low == DURATION_FULL ? 2 : 1;
 
-        if (*backlog_length && *backlog_level == 1)
+        if (parse->backlog_length && parse->backlog_level == 1)
         {
             ESP_LOGD(TAG, "Transition from high to low -> 1%s",
-                is_low_with_backlog ? " (with backlog)" : "");
-            *parsed_value <<= 1;
-            *parsed_value |= 1;
+                low == DURATION_FULL ? " (with backlog)" : "");
+            parse->value <<= 1;
+            parse->value |= 1;
+            parse->bits++;
 
-            *backlog_length = 0;
+            parse->backlog_length = 0;
 
-            if (is_low_with_backlog)
+            if (low == DURATION_FULL)
             {
-                *backlog_level = 0;
-                *backlog_length = half_period;
+                parse->backlog_level = 0;
+                parse->backlog_length = half_period;
             }
         }
-        else 
+        else
         {
-            *backlog_level = 0;
-            *backlog_length = half_period;
+            parse->backlog_level = 0;
+            parse->backlog_length = half_period;
         }
 
         /* High value */
-        if (is_within_tolerance(symbols[i].duration1, half_period * 2))
-            is_high_with_backlog = true;
-        else if (!is_within_tolerance(symbols[i].duration1, half_period))
+        if ((high = classify_duration(protocol, symbols[i].duration1)) ==
+            DURATION_INVALID)
         {
             ESP_LOGD(TAG, "Found invalid high value: %" PRId16,
                 symbols[i].duration1);
             return i;
         }
+        parse->halves_duration += symbols[i].duration1;
+        parse->halves += high == DURATION_FULL ? 2 : 1;
 
-        if (*backlog_length && *backlog_level == 0)
+        if (parse->backlog_length && parse->backlog_level == 0)
         {
             ESP_LOGD(TAG, "Transition from low to high -> 0%s",
-                is_high_with_backlog ? " (with backlog)" : "");
-            *parsed_value <<= 1;
-            *parsed_value |= 0; /* NOP */
+                high == DURATION_FULL ? " (with backlog)" : "");
+            parse->value <<= 1;
+            parse->value |= 0; /* NOP */
+            parse->bits++;
 
-            *backlog_length = 0;
+            parse->backlog_length = 0;
 
-            if (is_high_with_backlog)
+            if (high == DURATION_FULL)
             {
-                *backlog_level = 1;
-                *backlog_length = half_period;
+                parse->backlog_level = 1;
+                parse->backlog_length = half_period;
             }
         }
         else
         {
-            *backlog_level = 1;
-            *backlog_length = half_period;
+            parse->backlog_level = 1;
+            parse->backlog_length = half_period;
         }
     }
 
     return i;
 }
 
-uint64_t parse_manchester(rmt_symbol_word_t *symbols, size_t len,
-    uint16_t header_mark, uint16_t header_space, uint16_t half_period)
+/* Parses a single frame, starting at its header. Returns the number of
+ * symbols consumed, or 0 if it isn't a complete frame */
+static int parse_manchester_frame(const manchester_protocol_t *protocol,
+    rmt_symbol_word_t *symbols, size_t len, manchester_parse_t *parse)
 {
-    int index = 0;
-    uint16_t backlog_length = 0;
-    uint16_t backlog_level = 0;
-    uint16_t parsed_items = 0;
-    uint64_t parsed_value = 0;
+    int parsed_items;
+
+    memset(parse, 0, sizeof(*parse));
+    parse->header_mark = symbols[0].duration0;
+    parse->header_space = symbols[0].duration1;
 
-    if (!is_within_tolerance(symbols[index].duration0, header_mark))
+    if (!is_within_window(symbols[0].duration0,
+        protocol->windows.header_mark))
     {
-        ESP_LOGE(TAG, "Invalid header, missing mark");
+        ESP_LOGV(TAG, "Invalid header, missing mark");
         return 0;
     }
-    if (is_within_tolerance(symbols[index].duration1,
-        header_space + half_period))
+    if (is_within_window(symbols[0].duration1,
+        protocol->windows.header_space_ext))
     {
         /* Verify remaining backlog is a valid half_period and not just accepted
          * as such due to tolerance */
-        if (is_within_tolerance(symbols[index].duration1 - header_space,
-            half_period))
+        if (symbols[0].duration1 > protocol->windows.header_space_centre &&
+            is_within_window(symbols[0].duration1 -
+            protocol->windows.header_space_centre, protocol->windows.half))
         {
-            backlog_length = half_period;
-            backlog_level = symbols[index].level1;
+            parse->backlog_length = protocol->half_period;
+            parse->backlog_level = symbols[0].level1;
+            parse->header_space -= protocol->windows.half_period_centre;
         }
     }
-    else if (!is_within_tolerance(symbols[index].duration1, header_space))
+    else if (!is_within_window(symbols[0].duration1,
+        protocol->windows.header_space))
     {
-        ESP_LOGE(TAG, "Invalid header, missing space");
+        ESP_LOGV(TAG, "Invalid header, missing space");
         return 0;
     }
     ESP_LOGD(TAG, "Found valid header with %" PRIu16
-        " backlog, level: %" PRIu16, backlog_length, backlog_level);
+        " backlog, level: %" PRIu16, parse->backlog_length,
+        parse->backlog_level);
 
-    parsed_items = parse_manchester_data(&symbols[index + 1], len - 1,
-        half_period, &backlog_length,
-        &backlog_level, &parsed_value);
-    if (!parsed_items)
+    parsed_items = parse_manchester_data(protocol, &symbols[1], len - 1,
+        parse);
+    if (parse->bits != protocol->bits)
     {
-        ESP_LOGE(TAG, "Failed parsing manchester symbols");
+        ESP_LOGD(TAG, "Incomplete frame, %u/%u bits", parse->bits,
+            protocol->bits);
         return 0;
     }
-    index += parsed_items + 1;
     ESP_LOGD(TAG, "Tail of %d (backlog_length: %d, backlog_level: %d",
-        symbols[index].duration0, backlog_length, backlog_level);
+        symbols[parsed_items + 1].duration0, parse->backlog_length,
+        parse->backlog_level);
+
+    return parsed_items + 1;
+}
+
+/* Bitwise majority of the repeats, ties go to the first one */
+static uint64_t manchester_vote(const uint64_t *values, int count,
+    uint8_t bits)
+{
+    uint64_t value = 0;
+    int bit, i, ones;
+
+    for (bit = 0; bit < bits; bit++)
+    {
+        for (i = 0, ones = 0; i < count; i++)
+            ones += (values[i] >> bit) & 1;
+
+        if (ones * 2 > count ||
+            (ones * 2 == count && (values[0] >> bit) & 1))
+        {
+            value |= 1ULL << bit;
+        }
+    }
+
+    return value;
+}
+
+uint64_t parse_manchester(manchester_protocol_t *protocol,
+    rmt_symbol_word_t *symbols, size_t len)
+{
+    uint64_t values[MANCHESTER_MAX_REPEATS], value;
+    manchester_parse_t parse, first = {};
+    size_t index = 0;
+    int count = 0, consumed;
+
+    if (!protocol->initialized)
+        manchester_protocol_init(protocol);
+
+    /* Every repeat in the capture is parsed, so a corrupted, or missing,
+     * frame is outvoted by the others */
+    while (index < len && count < MANCHESTER_MAX_REPEATS)
+    {
+        if (!(consumed = parse_manchester_frame(protocol, &symbols[index],
+            len - index, &parse)))
+        {
+            /* Look for the next repeat's header */
+            index++;
+            continue;
+        }
+
+        if (!count)
+            first = parse;
+        values[count++] = parse.value;
+        index += consumed;
+    }
+
+    if (!count)
+    {
+        ESP_LOGE(TAG, "Failed parsing manchester symbols");
+        manchester_adapt(protocol, false, 0, 0, 0);
+        return 0;
+    }
+
+    value = manchester_vote(values, count, protocol->bits);
+    if (count != protocol->repeat || value != values[0])
+        ESP_LOGD(TAG, "Voted 0x%" PRIx64 " out of %d repeats", value, count);
+
+    manchester_adapt(protocol, true, first.header_mark, first.header_space,
+        first.halves_duration / first.halves);
+    return value;
+}
+
+uint64_t parse_pulse(pulse_protocol_t *protocol, rmt_symbol_word_t *symbols,
+    size_t len)
+{
+    uint64_t parsed_value = 0;
+    int i, bit;
+
+    if (!protocol->initialized)
+        pulse_protocol_init(protocol);
+
+    if (len < protocol->bits + 1 ||
+        !is_within_window(symbols[0].duration0,
+        protocol->windows.header_mark) ||
+        !is_within_window(symbols[0].duration1,
+        protocol->windows.header_space))
+    {
+        ESP_LOGD(TAG, "Invalid pulse header");
+        return 0;
+    }
+
+    for (i = 1; i <= protocol->bits; i++)
+    {
+        uint16_t mark = symbols[i].duration0, space = symbols[i].duration1;
+
+        /* The last space may be cut by the end of the capture, decide by the
+         * mark alone */
+        if (is_within_window(mark, protocol->windows.zero_mark) &&
+            (!space || is_within_window(space, protocol->windows.zero_space)))
+        {
+            bit = 0;
+        }
+        else if (is_within_window(mark, protocol->windows.one_mark) &&
+            (!space || is_within_window(space, protocol->windows.one_space)))
+        {
+            bit = 1;
+        }
+        else
+        {
+            ESP_LOGD(TAG, "Invalid pulse symbol {%d, %d} at %d", mark, space,
+                i);
+            return 0;
+        }
+
+        if (protocol->lsb_first)
+            parsed_value |= (uint64_t)bit << (i - 1);
+        else
+            parsed_value = (parsed_value << 1) | bit;
+    }
 
     return parsed_value;
 }
 
-#include <stdio.h> 
-int generate_manchester(uint16_t header_mark, uint16_t header_space,
-    uint16_t repeat, uint16_t tail_mark, uint16_t half_period, uint64_t value,
-    rmt_symbol_word_t **symbols, size_t *len)
+size_t manchester_frame_symbols(const manchester_protocol_t *protocol)
 {
-    int index = 0;
-    rmt_symbol_word_t header = {
-        .level0 = 0,
-        .duration0 = header_mark,
-        .level1 = 1,
-        .duration1 = header_space,
-    };
-    rmt_symbol_word_t footer = {
-        .level0 = 0,
-        .duration0 = tail_mark,
-        .level1 = 1,
-        .duration1 = 0x7FFF,
-    };
-    rmt_symbol_word_t bit0 = {
-        .level0 = 0,
-        .duration0 = half_period,
-        .level1 = 1,
-        .duration1 = half_period,
-    };
-    rmt_symbol_word_t bit1 = {
-        .level0 = 1,
-        .duration0 = half_period,
-        .level1 = 0,
-        .duration1 = half_period,
-    };
+    return ((1 + protocol->bits) * protocol->repeat) + 1;
+}
+
+size_t manchester_frame_size(const manchester_protocol_t *protocol)
+{
+    return sizeof(rmt_symbol_word_t) * manchester_frame_symbols(protocol);
+}
+
+rmt_symbol_word_t manchester_symbol(const manchester_protocol_t *protocol,
+    uint64_t value, size_t index)
+{
+    size_t position = index % (1 + protocol->bits);
+    int bit = protocol->bits - position;
+    rmt_symbol_word_t symbol;
+
+    if (index >= (1 + protocol->bits) * protocol->repeat)
+    {
+        /* Footer */
+        symbol.level0 = 0;
+        symbol.duration0 = protocol->tail_mark;
+        symbol.level1 = 1;
+        symbol.duration1 = 0x7FFF;
+    }
+    else if (!position)
+    {
+        /* Header */
+        symbol.level0 = 0;
+        symbol.duration0 = protocol->header_mark;
+        symbol.level1 = 1;
+        symbol.duration1 = protocol->header_space;
+    }
+    else
+    {
+        /* Bits are sent MSB first, a 1 is a high to low transition */
+        symbol.level0 = !!(value & (1ULL << bit));
+        symbol.duration0 = protocol->half_period;
+        symbol.level1 = !symbol.level0;
+        symbol.duration1 = protocol->half_period;
+    }
+
+    return symbol;
+}
 
-    *len = sizeof(**symbols) * (((1 + 34) * repeat) + 1);
-    if (!(*symbols = malloc(*len)))
+int generate_manchester(const manchester_protocol_t *protocol, uint64_t value,
+    rmt_symbol_word_t *symbols, size_t size)
+{
+    size_t index, len = manchester_frame_symbols(protocol);
+
+    if (size < manchester_frame_size(protocol))
         return -1;
 
-    for (int r = 0; r < repeat; r++)
+    for (index = 0; index < len; index++)
+        symbols[index] = manchester_symbol(protocol, value, index);
+
+    return 0;
+}
+
+/* Walks symbols as runs of a single level, merging consecutive durations of
+ * the same level, as the receiver sees them */
+typedef struct {
+    const manchester_protocol_t *protocol;
+    uint64_t value;
+    const rmt_symbol_word_t *symbols; /* NULL for generated symbols */
+    size_t len;
+    size_t half;
+} run_iter_t;
+
+static bool run_iter_half(run_iter_t *iter, size_t half, uint8_t *level,
+    uint16_t *duration)
+{
+    rmt_symbol_word_t symbol;
+
+    if (half / 2 >= iter->len)
+        return false;
+
+    symbol = iter->symbols ? iter->symbols[half / 2] :
+        manchester_symbol(iter->protocol, iter->value, half / 2);
+    *level = half % 2 ? symbol.level1 : symbol.level0;
+    *duration = half % 2 ? symbol.duration1 : symbol.duration0;
+
+    /* A zero duration marks the end of a capture */
+    return *duration != 0;
+}
+
+static bool run_iter_next(run_iter_t *iter, uint8_t *level,
+    uint32_t *duration)
+{
+    uint16_t half_duration;
+    uint8_t half_level;
+
+    if (!run_iter_half(iter, iter->half, level, &half_duration))
+        return false;
+
+    *duration = half_duration;
+    while (run_iter_half(iter, ++iter->half, &half_level, &half_duration) &&
+        half_level == *level)
+    {
+        *duration += half_duration;
+    }
+
+    return true;
+}
+
+int manchester_compare(const manchester_protocol_t *protocol, uint64_t value,
+    const rmt_symbol_word_t *symbols, size_t len)
+{
+    uint8_t tolerance = protocol->tolerance ? : TIMING_TOLERANCE_PERCENT;
+    run_iter_t captured = { .symbols = symbols, .len = len };
+    run_iter_t generated = {
+        .protocol = protocol,
+        .value = value,
+        .len = manchester_frame_symbols(protocol),
+    };
+    uint32_t captured_duration, generated_duration;
+    uint8_t captured_level, generated_level;
+
+    while (run_iter_next(&captured, &captured_level, &captured_duration))
+    {
+        if (!run_iter_next(&generated, &generated_level, &generated_duration) ||
+            captured_level != generated_level ||
+            abs((int)captured_duration - (int)generated_duration) * 100 >
+            generated_duration * tolerance)
+        {
+            return -1;
+        }
+    }
+
+    /* Only the idle level following the footer may remain */
+    if (run_iter_next(&generated, &generated_level, &generated_duration) &&
+        (generated_level != 1 ||
+        run_iter_next(&generated, &generated_level, &generated_duration)))
     {
-        (*symbols)[index++] = header;
-        for (int bit = 33; bit >=0 ; bit--)
-            (*symbols)[index++] = value & (1ULL << bit) ? bit1 : bit0;
+        return -1;
     }
-    (*symbols)[index++] = footer;
 
     return 0;
 }
@@ -4,11 +4,91 @@
 #include <driver/rmt_types.h>
 #include <stdint.h>
 
-uint64_t parse_manchester(rmt_symbol_word_t *symbols, size_t len,
-    uint16_t header_mark, uint16_t header_space, uint16_t half_period);
+#define MANCHESTER_ADAPTIVE_FRACTION_BITS 4
 
-int generate_manchester(uint16_t header_mark, uint16_t header_space,
-    uint16_t repeat, uint16_t tail_mark, uint16_t half_period, uint64_t value,
-    rmt_symbol_word_t **symbols, size_t *len);
+/* Types */
+typedef struct {
+    uint16_t lo;
+    uint16_t hi;
+} timing_window_t;
+
+typedef struct {
+    uint16_t header_mark;
+    uint16_t header_space;
+    uint16_t half_period;
+    uint16_t tail_mark;
+    uint8_t bits;
+    uint8_t repeat;
+    /* Timing tolerance in percent, 0 for the default */
+    uint8_t tolerance;
+    /* Integer tolerance windows, built once by manchester_protocol_init() */
+    struct {
+        timing_window_t header_mark;
+        timing_window_t header_space;
+        timing_window_t header_space_ext;
+        timing_window_t half;
+        timing_window_t full;
+        uint16_t header_space_centre;
+        uint16_t half_period_centre;
+    } windows;
+    /* Adaptive timing, windows are centred on running estimates taken from
+     * decoded frames, and the tolerance follows the failure rate */
+    struct {
+        uint8_t enabled;
+        uint8_t tolerance;
+        uint16_t decoded;
+        uint16_t failed;
+        /* Fixed point estimates, see MANCHESTER_ADAPTIVE_FRACTION_BITS */
+        uint32_t header_mark;
+        uint32_t header_space;
+        uint32_t half_period;
+    } adaptive;
+    uint8_t initialized;
+} manchester_protocol_t;
+
+/* Pulse distance codings (e.g. NEC) share the mark and differ in the space,
+ * pulse width codings (e.g. Sony SIRC) differ in the mark */
+typedef struct {
+    uint16_t header_mark;
+    uint16_t header_space;
+    uint16_t zero_mark;
+    uint16_t zero_space;
+    uint16_t one_mark;
+    uint16_t one_space;
+    uint8_t bits;
+    uint8_t lsb_first;
+    struct {
+        timing_window_t header_mark;
+        timing_window_t header_space;
+        timing_window_t zero_mark;
+        timing_window_t zero_space;
+        timing_window_t one_mark;
+        timing_window_t one_space;
+    } windows;
+    uint8_t initialized;
+} pulse_protocol_t;
+
+void manchester_protocol_init(manchester_protocol_t *protocol);
+/* The widest header windows adaptive timing may use */
+void manchester_protocol_header_bounds(const manchester_protocol_t *protocol,
+    timing_window_t *header_mark, timing_window_t *header_space);
+void pulse_protocol_init(pulse_protocol_t *protocol);
+
+uint64_t parse_manchester(manchester_protocol_t *protocol,
+    rmt_symbol_word_t *symbols, size_t len);
+
+uint64_t parse_pulse(pulse_protocol_t *protocol, rmt_symbol_word_t *symbols,
+    size_t len);
+
+/* Length of a complete frame, including all repeats and the footer */
+size_t manchester_frame_symbols(const manchester_protocol_t *protocol);
+size_t manchester_frame_size(const manchester_protocol_t *protocol);
+rmt_symbol_word_t manchester_symbol(const manchester_protocol_t *protocol,
+    uint64_t value, size_t index);
+int generate_manchester(const manchester_protocol_t *protocol, uint64_t value,
+    rmt_symbol_word_t *symbols, size_t size);
+/* Checks captured symbols match the generated frame, within tolerance */
+int manchester_compare(const manchester_protocol_t *protocol, uint64_t value,
+    const rmt_symbol_word_t *symbols, size_t len);
 
 #endif
@@ -0,0 +1,162 @@
+#include "replay.h"
+#include "ac.h"
+#include "capture.h"
+#include "histogram.h"
+#include <driver/rmt_types.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "REPLAY";
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+/* Same as the IR receive buffer */
+#define REPLAY_MAX_SYMBOLS 512
+/* Windows must not overlap, so tolerances stay below 33% */
+static const uint8_t replay_tolerances[] = { 10, 15, 20, 25, 30 };
+#define REPLAY_TOLERANCES sizeof(replay_tolerances)
+
+/* Types */
+typedef enum {
+    REPLAY_STATE_FILE_HEADER,
+    REPLAY_STATE_CAPTURE_HEADER,
+    REPLAY_STATE_SYMBOLS,
+} replay_state_t;
+
+struct replay_t {
+    replay_state_t state;
+    uint8_t *target;
+    size_t needed;
+    size_t offset;
+    uint8_t file_header[CAPTURE_FILE_HEADER_SIZE];
+    capture_header_t capture;
+    rmt_symbol_word_t symbols[REPLAY_MAX_SYMBOLS];
+    uint32_t frames;
+    replay_stats_t stats[REPLAY_TOLERANCES];
+    replay_on_capture_cb_t on_capture_cb;
+    void *on_capture_ctx;
+};
+
+static void replay_expect(replay_t *replay, replay_state_t state, void *target,
+    size_t needed)
+{
+    replay->state = state;
+    replay->target = target;
+    replay->needed = needed;
+    replay->offset = 0;
+}
+
+replay_t *replay_start(void)
+{
+    replay_t *replay = calloc(1, sizeof(*replay));
+    int i;
+
+    if (!replay)
+        return NULL;
+
+    for (i = 0; i < REPLAY_TOLERANCES; i++)
+        replay->stats[i].tolerance = replay_tolerances[i];
+
+    replay_expect(replay, REPLAY_STATE_FILE_HEADER, replay->file_header,
+        sizeof(replay->file_header));
+    return replay;
+}
+
+void replay_set_on_capture_cb(replay_t *replay, replay_on_capture_cb_t cb,
+    void *ctx)
+{
+    replay->on_capture_cb = cb;
+    replay->on_capture_ctx = ctx;
+}
+
+static void replay_frame(replay_t *replay)
+{
+    int i;
+
+    replay->frames++;
+    if (replay->on_capture_cb)
+    {
+        replay->on_capture_cb(&replay->capture, replay->symbols,
+            replay->on_capture_ctx);
+    }
+
+    for (i = 0; i < REPLAY_TOLERANCES; i++)
+    {
+        replay_stats_t *stats = &replay->stats[i];
+        int64_t start = esp_timer_get_time();
+        ac_replay_result_t result = ac_ir_replay(replay->symbols,
+            replay->capture.len, stats->tolerance);
+
+        stats->results[result]++;
+        histogram_add(&stats->time_us, esp_timer_get_time() - start);
+    }
+}
+
+static int replay_advance(replay_t *replay)
+{
+    switch (replay->state)
+    {
+    case REPLAY_STATE_FILE_HEADER:
+        if (memcmp(replay->file_header, CAPTURE_MAGIC, 4) ||
+            replay->file_header[4] != CAPTURE_VERSION)
+        {
+            ESP_LOGE(TAG, "Invalid capture file header");
+            return -1;
+        }
+        break;
+    case REPLAY_STATE_CAPTURE_HEADER:
+        if (replay->capture.len > REPLAY_MAX_SYMBOLS)
+        {
+            ESP_LOGE(TAG, "Capture of %u symbols is too long",
+                replay->capture.len);
+            return -1;
+        }
+        if (!replay->capture.len)
+            break;
+        replay_expect(replay, REPLAY_STATE_SYMBOLS, (uint8_t *)replay->symbols,
+            replay->capture.len * sizeof(*replay->symbols));
+        return 0;
+    case REPLAY_STATE_SYMBOLS:
+        replay_frame(replay);
+        break;
+    }
+
+    replay_expect(replay, REPLAY_STATE_CAPTURE_HEADER,
+        (uint8_t *)&replay->capture, sizeof(replay->capture));
+    return 0;
+}
+
+int replay_feed(replay_t *replay, const uint8_t *data, size_t len)
+{
+    while (len)
+    {
+        size_t copy = MIN(replay->needed - replay->offset, len);
+
+        memcpy(replay->target + replay->offset, data, copy);
+        replay->offset += copy;
+        data += copy;
+        len -= copy;
+
+        if (replay->offset == replay->needed && replay_advance(replay))
+            return -1;
+    }
+
+    return 0;
+}
+
+uint32_t replay_frames_get(replay_t *replay)
+{
+    return replay->frames;
+}
+
+const replay_stats_t *replay_stats_get(replay_t *replay, unsigned int index)
+{
+    return index < REPLAY_TOLERANCES ? &replay->stats[index] : NULL;
+}
+
+void replay_free(replay_t *replay)
+{
+    free(replay);
+}
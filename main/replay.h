@@ -0,0 +1,38 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "ac.h"
+#include "capture.h"
+#include "histogram.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/* Types */
+typedef struct replay_t replay_t;
+
+/* Results at a single timing tolerance */
+typedef struct {
+    uint8_t tolerance;
+    uint32_t results[AC_REPLAY_FAILED + 1];
+    /* Time spent on each frame, in uS */
+    histogram_t time_us;
+} replay_stats_t;
+
+/* Event callback types */
+typedef void (*replay_on_capture_cb_t)(const capture_header_t *capture,
+    const rmt_symbol_word_t *symbols, void *ctx);
+
+/* Runs a corpus of captures, in the capture export format, through the AC
+ * decode and re-encode pipeline at several timing tolerances */
+replay_t *replay_start(void);
+/* Called with each capture before it's replayed, e.g. to also run it through
+ * the live AC pipeline */
+void replay_set_on_capture_cb(replay_t *replay, replay_on_capture_cb_t cb,
+    void *ctx);
+int replay_feed(replay_t *replay, const uint8_t *data, size_t len);
+uint32_t replay_frames_get(replay_t *replay);
+/* Returns NULL past the last tolerance */
+const replay_stats_t *replay_stats_get(replay_t *replay, unsigned int index);
+void replay_free(replay_t *replay);
+
+#endif
@@ -0,0 +1,192 @@
+#include "topics.h"
+#include <esp_log.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "TOPICS";
+
+static const char *topic_names[TOPIC_MAX] = {
+    [TOPIC_POWER] = "Power",
+    [TOPIC_POWER_SET] = "Power/Set",
+    [TOPIC_TEMPERATURE] = "Temperature",
+    [TOPIC_TEMPERATURE_SET] = "Temperature/Set",
+    [TOPIC_MODE] = "Mode",
+    [TOPIC_MODE_SET] = "Mode/Set",
+    [TOPIC_FAN] = "Fan",
+    [TOPIC_FAN_SET] = "Fan/Set",
+    [TOPIC_STATE] = "State",
+    [TOPIC_STATE_SET] = "State/Set",
+    [TOPIC_ACTION] = "Action",
+    [TOPIC_STATUS] = "Status",
+    [TOPIC_VERSION] = "Version",
+    [TOPIC_CONFIG_VERSION] = "ConfigVersion",
+    [TOPIC_UPTIME] = "Uptime",
+    [TOPIC_FREE_MEMORY] = "FreeMemory",
+    [TOPIC_MIN_FREE_MEMORY] = "MinFreeMemory",
+    [TOPIC_LARGEST_FREE_BLOCK] = "LargestFreeBlock",
+    [TOPIC_DIAGNOSTICS_TASKS] = "Diagnostics/Tasks",
+    [TOPIC_DIAGNOSTICS_LATENCY] = "Diagnostics/Latency",
+    [TOPIC_LATENCY_AVG_PRESS_TO_TX] = "Latency/AvgPressToTx",
+    [TOPIC_LATENCY_MAX_PRESS_TO_TX] = "Latency/MaxPressToTx",
+    [TOPIC_PROTOCOL] = "Protocol",
+    [TOPIC_FLASH_COMMITS] = "FlashCommits",
+    [TOPIC_EVENT_QUEUE_DEPTH] = "EventQueue/Depth",
+    [TOPIC_EVENT_QUEUE_HIGH_WATER_MARK] = "EventQueue/HighWaterMark",
+    [TOPIC_EVENT_QUEUE_DROPPED] = "EventQueue/Dropped",
+    [TOPIC_IR_DECODED] = "IR/Decoded",
+    [TOPIC_IR_FAILED] = "IR/Failed",
+    [TOPIC_IR_SENDS_COALESCED] = "IR/SendsCoalesced",
+    [TOPIC_MQTT_PUBLISH_FAILURES] = "MQTT/PublishFailures",
+    [TOPIC_MQTT_OFFLINE_QUEUE_REPLACED] = "MQTT/OfflineQueue/Replaced",
+    [TOPIC_MQTT_OFFLINE_QUEUE_DROPPED] = "MQTT/OfflineQueue/Dropped",
+    [TOPIC_MQTT_OFFLINE_QUEUE_REPLAYED] = "MQTT/OfflineQueue/Replayed",
+    [TOPIC_OTA_FIRMWARE] = "OTA/Firmware",
+    [TOPIC_OTA_CONFIG] = "OTA/Config",
+    [TOPIC_CAPTURE] = "Capture",
+    [TOPIC_CAPTURE_GET] = "Capture/Get",
+    [TOPIC_ALL_OTA_FIRMWARE] = "OTA/Firmware",
+    [TOPIC_ALL_OTA_CONFIG] = "OTA/Config",
+};
+
+static const char *topic_decoder_names[TOPIC_DECODER_MAX] = {
+    [TOPIC_DECODER_DECODED] = "Decoded",
+    [TOPIC_DECODER_FAILED] = "Failed",
+    [TOPIC_DECODER_AVG_DECODE_TIME] = "AvgDecodeTime",
+    [TOPIC_DECODER_MAX_DECODE_TIME] = "MaxDecodeTime",
+    [TOPIC_DECODER_TOLERANCE] = "Tolerance",
+    [TOPIC_DECODER_HALF_PERIOD] = "HalfPeriod",
+    [TOPIC_DECODER_HEADER_MARK] = "HeaderMark",
+    [TOPIC_DECODER_HEADER_SPACE] = "HeaderSpace",
+};
+
+typedef struct topics_decoder_t {
+    struct topics_decoder_t *next;
+    const ir_protocol_t *protocol;
+    char *topics[TOPIC_DECODER_MAX];
+} topics_decoder_t;
+
+/* Internal state */
+static char *topics[TOPIC_MAX] = {};
+static char *rejected_frames_topics[AC_REJECT_MAX] = {};
+static topics_decoder_t *decoders = NULL;
+static char *device_base = NULL;
+static int failed = 0;
+
+const char *topic_get(topic_t topic)
+{
+    return topics[topic];
+}
+
+const char *topic_rejected_frames_get(ac_reject_t reason)
+{
+    return rejected_frames_topics[reason];
+}
+
+const char *topic_decoder_get(const ir_protocol_t *protocol,
+    topic_decoder_t topic)
+{
+    topics_decoder_t *decoder;
+
+    for (decoder = decoders; decoder; decoder = decoder->next)
+    {
+        if (decoder->protocol == protocol)
+            return decoder->topics[topic];
+    }
+
+    return NULL;
+}
+
+static char *topic_format(const char *fmt, ...)
+{
+    va_list ap;
+    char *topic;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+
+    if (!(topic = malloc(len + 1)))
+    {
+        failed = 1;
+        return NULL;
+    }
+
+    va_start(ap, fmt);
+    vsnprintf(topic, len + 1, fmt, ap);
+    va_end(ap);
+
+    return topic;
+}
+
+static void topics_decoder_add(const ir_protocol_t *protocol, void *ctx)
+{
+    topics_decoder_t *decoder = calloc(1, sizeof(*decoder));
+    topic_decoder_t topic;
+
+    if (!decoder)
+    {
+        failed = 1;
+        return;
+    }
+
+    for (topic = 0; topic < TOPIC_DECODER_MAX; topic++)
+    {
+        decoder->topics[topic] = topic_format("%s/Decoder/%s/%s",
+            device_base, protocol->name, topic_decoder_names[topic]);
+    }
+
+    decoder->protocol = protocol;
+    decoder->next = decoders;
+    decoders = decoder;
+}
+
+int topics_initialize(const char *prefix, const char *device_name)
+{
+    char *all_base;
+    topic_t topic;
+    ac_reject_t reason;
+
+    ESP_LOGD(TAG, "Initializing topics of %s, prefix: %s", device_name,
+        prefix ? : "none");
+
+    if (prefix && *prefix)
+    {
+        device_base = topic_format("%s/%s", prefix, device_name);
+        all_base = topic_format("%s/AC-MITM", prefix);
+    }
+    else
+    {
+        device_base = topic_format("%s", device_name);
+        all_base = topic_format("AC-MITM");
+    }
+
+    if (failed)
+        goto Error;
+
+    for (topic = 0; topic < TOPIC_MAX; topic++)
+    {
+        topics[topic] = topic_format("%s/%s", topic < TOPIC_ALL_OTA_FIRMWARE ?
+            device_base : all_base, topic_names[topic]);
+    }
+
+    for (reason = AC_REJECT_NONE + 1; reason < AC_REJECT_MAX; reason++)
+    {
+        rejected_frames_topics[reason] = topic_format("%s/RejectedFrames/%s",
+            device_base, ac_reject_to_str(reason));
+    }
+
+    ir_decoder_foreach(topics_decoder_add, NULL);
+
+Error:
+    free(all_base);
+    if (failed)
+    {
+        ESP_LOGE(TAG, "Failed allocating topics");
+        return -1;
+    }
+
+    return 0;
+}
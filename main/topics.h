@@ -0,0 +1,80 @@
+#ifndef TOPICS_H
+#define TOPICS_H
+
+#include "ac.h"
+#include "ir_decoder.h"
+
+/* Topics of this device, i.e. [<prefix>/]<device name>/<topic> */
+typedef enum {
+    /* AC state and commands */
+    TOPIC_POWER,
+    TOPIC_POWER_SET,
+    TOPIC_TEMPERATURE,
+    TOPIC_TEMPERATURE_SET,
+    TOPIC_MODE,
+    TOPIC_MODE_SET,
+    TOPIC_FAN,
+    TOPIC_FAN_SET,
+    TOPIC_STATE,
+    TOPIC_STATE_SET,
+    TOPIC_ACTION,
+    /* Bookkeeping */
+    TOPIC_STATUS,
+    TOPIC_VERSION,
+    TOPIC_CONFIG_VERSION,
+    TOPIC_UPTIME,
+    TOPIC_FREE_MEMORY,
+    TOPIC_MIN_FREE_MEMORY,
+    TOPIC_LARGEST_FREE_BLOCK,
+    TOPIC_DIAGNOSTICS_TASKS,
+    TOPIC_DIAGNOSTICS_LATENCY,
+    TOPIC_LATENCY_AVG_PRESS_TO_TX,
+    TOPIC_LATENCY_MAX_PRESS_TO_TX,
+    TOPIC_PROTOCOL,
+    TOPIC_FLASH_COMMITS,
+    TOPIC_EVENT_QUEUE_DEPTH,
+    TOPIC_EVENT_QUEUE_HIGH_WATER_MARK,
+    TOPIC_EVENT_QUEUE_DROPPED,
+    TOPIC_IR_DECODED,
+    TOPIC_IR_FAILED,
+    TOPIC_IR_SENDS_COALESCED,
+    TOPIC_MQTT_PUBLISH_FAILURES,
+    TOPIC_MQTT_OFFLINE_QUEUE_REPLACED,
+    TOPIC_MQTT_OFFLINE_QUEUE_DROPPED,
+    TOPIC_MQTT_OFFLINE_QUEUE_REPLAYED,
+    /* OTA and IR captures */
+    TOPIC_OTA_FIRMWARE,
+    TOPIC_OTA_CONFIG,
+    TOPIC_CAPTURE,
+    TOPIC_CAPTURE_GET,
+    /* Shared by all devices, i.e. [<prefix>/]AC-MITM/<topic> */
+    TOPIC_ALL_OTA_FIRMWARE,
+    TOPIC_ALL_OTA_CONFIG,
+    TOPIC_MAX,
+} topic_t;
+
+/* Per IR protocol topics, i.e. .../Decoder/<protocol>/<topic> */
+typedef enum {
+    TOPIC_DECODER_DECODED,
+    TOPIC_DECODER_FAILED,
+    TOPIC_DECODER_AVG_DECODE_TIME,
+    TOPIC_DECODER_MAX_DECODE_TIME,
+    TOPIC_DECODER_TOLERANCE,
+    TOPIC_DECODER_HALF_PERIOD,
+    TOPIC_DECODER_HEADER_MARK,
+    TOPIC_DECODER_HEADER_SPACE,
+    TOPIC_DECODER_MAX,
+} topic_decoder_t;
+
+/* All topics are built once, these only look them up */
+const char *topic_get(topic_t topic);
+const char *topic_rejected_frames_get(ac_reject_t reason);
+/* NULL if the protocol was registered after the topics were built */
+const char *topic_decoder_get(const ir_protocol_t *protocol,
+    topic_decoder_t topic);
+
+/* Must be called once all IR protocols were registered. The prefix is
+ * optional */
+int topics_initialize(const char *prefix, const char *device_name);
+
+#endif
@@ -0,0 +1,93 @@
+#include "ir_capture.h"
+#include "protocol_parsers.h"
+#include "reference_parsers.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Decoder throughput over pre-generated jittery captures */
+#define FRAMES 1024
+#define ROUNDS 200
+#define MAX_SYMBOLS 512
+
+typedef struct {
+    rmt_symbol_word_t symbols[MAX_SYMBOLS];
+    size_t len;
+} capture_t;
+
+typedef uint64_t (*parser_t)(manchester_protocol_t *protocol,
+    rmt_symbol_word_t *symbols, size_t len);
+
+/* Same timing as the Airwell remote */
+static manchester_protocol_t airwell = {
+    .header_mark = 3 * 950,
+    .header_space = 3 * 950,
+    .half_period = 950,
+    .tail_mark = 4 * 950,
+    .bits = 34,
+    .repeat = 3,
+};
+
+static uint64_t reference_parser(manchester_protocol_t *protocol,
+    rmt_symbol_word_t *symbols, size_t len)
+{
+    return reference_parse_manchester(symbols, len, protocol->header_mark,
+        protocol->header_space, protocol->half_period);
+}
+
+static double now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+static void bench(const char *name, parser_t parser, uint8_t repeat,
+    capture_t *captures)
+{
+    manchester_protocol_t protocol = airwell;
+    unsigned int decoded = 0;
+    size_t symbols = 0, i, round;
+    double start, elapsed;
+
+    protocol.repeat = repeat;
+    manchester_protocol_init(&protocol);
+    ir_capture_seed(1);
+    for (i = 0; i < FRAMES; i++)
+    {
+        captures[i].len = ir_capture_simulate(&protocol,
+            ir_capture_random_value(&protocol), 10, 100, captures[i].symbols,
+            MAX_SYMBOLS);
+        symbols += captures[i].len;
+    }
+
+    start = now_ns();
+    for (round = 0; round < ROUNDS; round++)
+    {
+        for (i = 0; i < FRAMES; i++)
+            decoded += !!parser(&protocol, captures[i].symbols, captures[i].len);
+    }
+    elapsed = now_ns() - start;
+
+    printf("%-28s %u repeat(s): %9.0f frames/s, %6.2f ns/symbol, "
+        "%u/%u decoded\n", name, repeat, FRAMES * ROUNDS / (elapsed / 1e9),
+        elapsed / (symbols * ROUNDS), decoded, FRAMES * ROUNDS);
+}
+
+int main(void)
+{
+    capture_t *captures = malloc(FRAMES * sizeof(*captures));
+
+    if (!captures)
+        return 1;
+
+    /* The reference decoder stops after the first repeat, so both are
+     * compared on single repeat captures as well */
+    bench("reference_parse_manchester", reference_parser, 1, captures);
+    bench("parse_manchester", parse_manchester, 1, captures);
+    bench("parse_manchester", parse_manchester, airwell.repeat, captures);
+
+    free(captures);
+    return 0;
+}
@@ -0,0 +1,62 @@
+#include "fakes.h"
+#include "config.h"
+#include "ir.h"
+#include <esp_timer.h>
+#include <string.h>
+#include <time.h>
+
+/* Stand-ins for the ESP-IDF and device modules the codecs depend on */
+fake_ir_sent_t fake_ir_sent = {};
+
+static int64_t time_offset = 0;
+static uint64_t persistent_state = 0;
+static char learned_protocol[32] = "";
+
+void fake_time_advance(int64_t us)
+{
+    time_offset += us;
+}
+
+int64_t esp_timer_get_time(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000 + time_offset;
+}
+
+uint8_t config_ac_adaptive_timing_get(void)
+{
+    return 0;
+}
+
+int config_ac_persistent_save(uint64_t data)
+{
+    persistent_state = data;
+    return 0;
+}
+
+uint64_t config_ac_persistent_load(void)
+{
+    return persistent_state;
+}
+
+const char *config_ac_learned_protocol_get(void)
+{
+    return *learned_protocol ? learned_protocol : NULL;
+}
+
+int config_ac_learned_protocol_set(const char *protocol)
+{
+    strncpy(learned_protocol, protocol, sizeof(learned_protocol) - 1);
+    return 0;
+}
+
+int ir_send_manchester(const manchester_protocol_t *protocol, uint64_t value,
+    int64_t origin)
+{
+    fake_ir_sent.protocol = protocol;
+    fake_ir_sent.value = value;
+    fake_ir_sent.count++;
+    return 0;
+}
@@ -0,0 +1,20 @@
+#ifndef HOST_FAKES_H
+#define HOST_FAKES_H
+
+#include "protocol_parsers.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/* Moves esp_timer_get_time() forward, e.g. past the duplicate frame window */
+void fake_time_advance(int64_t us);
+
+/* The last frame passed to ir_send_manchester(), and the number of sends */
+typedef struct {
+    const manchester_protocol_t *protocol;
+    uint64_t value;
+    unsigned int count;
+} fake_ir_sent_t;
+
+extern fake_ir_sent_t fake_ir_sent;
+
+#endif
@@ -0,0 +1,96 @@
+#include "ir_capture.h"
+#include <stdlib.h>
+
+#define MAX_DURATION 0x7FFF
+
+static uint32_t random_state = 1;
+
+void ir_capture_seed(uint32_t seed)
+{
+    random_state = seed ? seed : 1;
+}
+
+uint32_t ir_capture_random(void)
+{
+    /* xorshift32 */
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+uint64_t ir_capture_random_value(const manchester_protocol_t *protocol)
+{
+    uint64_t value = (uint64_t)ir_capture_random() << 32 | ir_capture_random();
+
+    if (protocol->bits < 64)
+        value &= (1ULL << protocol->bits) - 1;
+
+    /* A trailing 1 ends on a mark that merges with the next header's, so
+     * it can't be told apart. Airwell frames always end with a 0 */
+    return value & ~1ULL;
+}
+
+static uint32_t jittered(const manchester_protocol_t *protocol,
+    uint32_t duration, unsigned int jitter, unsigned int scale_percent)
+{
+    int32_t span = protocol->half_period * jitter / 100;
+
+    duration = duration * scale_percent / 100;
+    if (span)
+        duration += (int32_t)(ir_capture_random() % (2 * span + 1)) - span;
+
+    return duration > MAX_DURATION ? MAX_DURATION : duration;
+}
+
+size_t ir_capture_simulate(const manchester_protocol_t *protocol,
+    uint64_t value, unsigned int jitter, unsigned int scale_percent,
+    rmt_symbol_word_t *symbols, size_t max_symbols)
+{
+    size_t frame_len = manchester_frame_symbols(protocol);
+    uint8_t *levels = malloc(2 * frame_len);
+    uint32_t *durations = malloc(2 * frame_len * sizeof(*durations));
+    size_t runs = 0, len = 0, i;
+
+    if (!levels || !durations)
+        goto out;
+
+    /* Adjacent halves of the same level are a single mark or space */
+    for (i = 0; i < 2 * frame_len; i++)
+    {
+        rmt_symbol_word_t symbol = manchester_symbol(protocol, value, i / 2);
+        uint8_t level = i % 2 ? symbol.level1 : symbol.level0;
+        uint32_t duration = i % 2 ? symbol.duration1 : symbol.duration0;
+
+        if (runs && levels[runs - 1] == level)
+        {
+            durations[runs - 1] += duration;
+            continue;
+        }
+        levels[runs] = level;
+        durations[runs++] = duration;
+    }
+
+    /* Frames start with a mark and end with the idle level, on which the
+     * receiver stops and reports a duration of 0 */
+    durations[runs - 1] = 0;
+
+    if (runs / 2 > max_symbols)
+        goto out;
+
+    for (i = 0; i < runs; i += 2, len++)
+    {
+        symbols[len].level0 = levels[i];
+        symbols[len].duration0 = jittered(protocol, durations[i], jitter,
+            scale_percent);
+        symbols[len].level1 = levels[i + 1];
+        symbols[len].duration1 = durations[i + 1] ?
+            jittered(protocol, durations[i + 1], jitter,
+            scale_percent) : 0;
+    }
+
+out:
+    free(levels);
+    free(durations);
+    return len;
+}
@@ -0,0 +1,25 @@
+#ifndef HOST_IR_CAPTURE_H
+#define HOST_IR_CAPTURE_H
+
+#include "protocol_parsers.h"
+#include <driver/rmt_types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Deterministic pseudo random numbers, so failures can be reproduced */
+void ir_capture_seed(uint32_t seed);
+uint32_t ir_capture_random(void);
+
+/* Turns a generated frame into what the RMT receiver would capture: runs of
+ * the same level are merged into marks and spaces, scaled by scale_percent,
+ * and each shifted by up to jitter percent of the half period, as receivers
+ * jitter by a fixed amount regardless of the duration. Returns the number of
+ * symbols, or 0 if they don't fit */
+size_t ir_capture_simulate(const manchester_protocol_t *protocol,
+    uint64_t value, unsigned int jitter, unsigned int scale_percent,
+    rmt_symbol_word_t *symbols, size_t max_symbols);
+
+/* A random value of the protocol's width, ending with a 0 bit */
+uint64_t ir_capture_random_value(const manchester_protocol_t *protocol);
+
+#endif
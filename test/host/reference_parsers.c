@@ -0,0 +1,114 @@
+#include "reference_parsers.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/* parse_manchester() as of the initial import, with the logging removed */
+static const uint16_t TIMING_TOLERANCE_PERCENT = 25;
+
+static bool is_within_tolerance(uint16_t value, uint16_t expected)
+{
+    uint16_t lowerLimit = expected * (1 - (TIMING_TOLERANCE_PERCENT / 100.0));
+    uint16_t upperLimit = expected * (1 + (TIMING_TOLERANCE_PERCENT / 100.0));
+
+    return lowerLimit <= value && value <= upperLimit;
+}
+
+static int parse_manchester_data(rmt_symbol_word_t *symbols, size_t len,
+    uint16_t half_period, uint16_t *backlog_length, uint16_t *backlog_level,
+        uint64_t *parsed_value)
+{
+    int i;
+
+    for (i = 0; i < len; i++)
+    {
+        bool is_low_with_backlog = false;
+        bool is_high_with_backlog = false;
+
+        /* Low value */
+        if (is_within_tolerance(symbols[i].duration0, half_period * 2))
+            is_low_with_backlog = true;
+        else if (!is_within_tolerance(symbols[i].duration0, half_period))
+            return i;
+
+        if (*backlog_length && *backlog_level == 1)
+        {
+            *parsed_value <<= 1;
+            *parsed_value |= 1;
+
+            *backlog_length = 0;
+
+            if (is_low_with_backlog)
+            {
+                *backlog_level = 0;
+                *backlog_length = half_period;
+            }
+        }
+        else
+        {
+            *backlog_level = 0;
+            *backlog_length = half_period;
+        }
+
+        /* High value */
+        if (is_within_tolerance(symbols[i].duration1, half_period * 2))
+            is_high_with_backlog = true;
+        else if (!is_within_tolerance(symbols[i].duration1, half_period))
+            return i;
+
+        if (*backlog_length && *backlog_level == 0)
+        {
+            *parsed_value <<= 1;
+            *parsed_value |= 0; /* NOP */
+
+            *backlog_length = 0;
+
+            if (is_high_with_backlog)
+            {
+                *backlog_level = 1;
+                *backlog_length = half_period;
+            }
+        }
+        else
+        {
+            *backlog_level = 1;
+            *backlog_length = half_period;
+        }
+    }
+
+    return i;
+}
+
+uint64_t reference_parse_manchester(rmt_symbol_word_t *symbols, size_t len,
+    uint16_t header_mark, uint16_t header_space, uint16_t half_period)
+{
+    int index = 0;
+    uint16_t backlog_length = 0;
+    uint16_t backlog_level = 0;
+    uint16_t parsed_items = 0;
+    uint64_t parsed_value = 0;
+
+    if (!is_within_tolerance(symbols[index].duration0, header_mark))
+        return 0;
+    if (is_within_tolerance(symbols[index].duration1,
+        header_space + half_period))
+    {
+        /* Verify remaining backlog is a valid half_period and not just accepted
+         * as such due to tolerance */
+        if (is_within_tolerance(symbols[index].duration1 - header_space,
+            half_period))
+        {
+            backlog_length = half_period;
+            backlog_level = symbols[index].level1;
+        }
+    }
+    else if (!is_within_tolerance(symbols[index].duration1, header_space))
+        return 0;
+
+    parsed_items = parse_manchester_data(&symbols[index + 1], len - 1,
+        half_period, &backlog_length,
+        &backlog_level, &parsed_value);
+    if (!parsed_items)
+        return 0;
+
+    return parsed_value;
+}
@@ -0,0 +1,12 @@
+#ifndef HOST_REFERENCE_PARSERS_H
+#define HOST_REFERENCE_PARSERS_H
+
+#include <driver/rmt_types.h>
+#include <stdint.h>
+
+/* The original decoder, with floating point tolerance checks on every
+ * duration, kept as the benchmark's baseline */
+uint64_t reference_parse_manchester(rmt_symbol_word_t *symbols, size_t len,
+    uint16_t header_mark, uint16_t header_space, uint16_t half_period);
+
+#endif
@@ -0,0 +1,180 @@
+#include "ac.h"
+#include "capture.h"
+#include "fakes.h"
+#include "ir_capture.h"
+#include "ir_decoder.h"
+#include "replay.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Runs a capture corpus, as exported by GET /capture or the Capture MQTT
+ * topic, through the live AC pipeline (decode, apply, send) and through the
+ * same tolerance sweep as POST /replay. Without a corpus, a synthetic one of
+ * jittery Airwell frames is replayed and every frame must match, in the
+ * pipeline and at the default tolerance */
+#define SYNTHETIC_FRAMES 200
+#define SYNTHETIC_JITTER 10
+#define DEFAULT_TOLERANCE 25
+#define MAX_SYMBOLS 512
+
+/* Results of the live pipeline, at the decoder's own tolerance */
+typedef struct {
+    uint32_t results[AC_REPLAY_FAILED + 1];
+    uint32_t duplicates;
+} pipeline_t;
+
+/* As the AC task handles a remote's frame, the sent frame must match it */
+static void pipeline_on_capture(const capture_header_t *capture,
+    const rmt_symbol_word_t *symbols, void *ctx)
+{
+    pipeline_t *pipeline = ctx;
+    unsigned int sends = fake_ir_sent.count;
+    int ret;
+
+    if ((ret = ac_ir_recv((rmt_symbol_word_t *)symbols, capture->len,
+        capture->timestamp * 1000LL)) < 0)
+        pipeline->results[AC_REPLAY_FAILED]++;
+    else if (ret)
+        pipeline->duplicates++;
+    else if (ac_ir_send(0) || fake_ir_sent.count == sends ||
+        manchester_compare(fake_ir_sent.protocol, fake_ir_sent.value, symbols,
+        capture->len))
+    {
+        pipeline->results[AC_REPLAY_MISMATCHED]++;
+    }
+    else
+        pipeline->results[AC_REPLAY_MATCHED]++;
+}
+
+static int feed_file(replay_t *replay, const char *path)
+{
+    uint8_t buf[1024];
+    size_t len;
+    FILE *f;
+    int ret = 0;
+
+    if (!(f = fopen(path, "rb")))
+    {
+        perror(path);
+        return -1;
+    }
+
+    /* Fed in chunks, as the HTTP handler does */
+    while (!ret && (len = fread(buf, 1, sizeof(buf), f)))
+        ret = replay_feed(replay, buf, len);
+
+    fclose(f);
+    return ret;
+}
+
+static int feed_synthetic(replay_t *replay)
+{
+    uint8_t header[CAPTURE_FILE_HEADER_SIZE] = { 'I', 'R', 'C', 'P',
+        CAPTURE_VERSION, SYNTHETIC_FRAMES };
+    rmt_symbol_word_t symbols[MAX_SYMBOLS];
+    capture_header_t capture = {};
+    int i;
+
+    if (replay_feed(replay, header, sizeof(header)))
+        return -1;
+
+    ir_capture_seed(1);
+    for (i = 0; i < SYNTHETIC_FRAMES; i++)
+    {
+        int temperature = 16 + ir_capture_random() % 15;
+
+        ac_set_temperature(temperature);
+        ac_set_mode(ir_capture_random() % (AC_MODE_AUTO + 1));
+        ac_set_fan(ir_capture_random() % (AC_FAN_AUTO + 1));
+        if (ac_ir_send(0))
+            return -1;
+        /* Move away from the sent state, the pipeline must bring it back */
+        ac_set_temperature(temperature == 16 ? 30 : 16);
+        ac_set_mode(ac_get_mode() == AC_MODE_COOL ? AC_MODE_HEAT :
+            AC_MODE_COOL);
+        ac_set_fan(ac_get_fan() == AC_FAN_LOW ? AC_FAN_HIGH : AC_FAN_LOW);
+
+        capture.timestamp = i * 1000;
+        capture.len = ir_capture_simulate(fake_ir_sent.protocol,
+            fake_ir_sent.value, SYNTHETIC_JITTER, 100, symbols, MAX_SYMBOLS);
+        if (replay_feed(replay, (uint8_t *)&capture, sizeof(capture)) ||
+            replay_feed(replay, (uint8_t *)symbols,
+            capture.len * sizeof(*symbols)))
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *corpus = argc > 1 ? argv[1] : NULL;
+    const replay_stats_t *stats;
+    pipeline_t pipeline = {};
+    uint32_t frames, matched = 0;
+    replay_t *replay;
+    unsigned int i;
+    int ret;
+
+    if (argc > 3 || (corpus && !strcmp(corpus, "-h")))
+    {
+        fprintf(stderr, "Usage: %s [corpus] [model]\n", argv[0]);
+        return 1;
+    }
+
+    if (ir_decoder_initialize() || ac_initialize(argc > 2 ? argv[2] :
+        "airwell") || !(replay = replay_start()))
+    {
+        fprintf(stderr, "Failed initializing the replay\n");
+        return 1;
+    }
+
+    /* The AC is on, so frames don't carry a power toggle */
+    ac_set_detected_power(1);
+    ac_set_power(1);
+    replay_set_on_capture_cb(replay, pipeline_on_capture, &pipeline);
+
+    if ((corpus ? feed_file(replay, corpus) : feed_synthetic(replay)))
+    {
+        fprintf(stderr, "Failed replaying the corpus\n");
+        replay_free(replay);
+        return 1;
+    }
+
+    frames = replay_frames_get(replay);
+    printf("%u frames\n", frames);
+    printf("pipeline: %u matched, %u mismatched, %u duplicates, %u failed\n",
+        pipeline.results[AC_REPLAY_MATCHED],
+        pipeline.results[AC_REPLAY_MISMATCHED], pipeline.duplicates,
+        pipeline.results[AC_REPLAY_FAILED]);
+    printf("%9s %8s %10s %8s %12s %8s %8s %8s\n", "tolerance", "matched",
+        "mismatched", "failed", "frames/s", "p50_us", "p99_us", "max_us");
+    for (i = 0; (stats = replay_stats_get(replay, i)); i++)
+    {
+        printf("%8u%% %8u %10u %8u %12.0f %8u %8u %8u\n", stats->tolerance,
+            stats->results[AC_REPLAY_MATCHED],
+            stats->results[AC_REPLAY_MISMATCHED],
+            stats->results[AC_REPLAY_FAILED], stats->time_us.total ?
+            frames * 1000000.0 / stats->time_us.total : 0,
+            histogram_percentile(&stats->time_us, 50),
+            histogram_percentile(&stats->time_us, 99), stats->time_us.max);
+
+        if (stats->tolerance == DEFAULT_TOLERANCE)
+            matched = stats->results[AC_REPLAY_MATCHED];
+    }
+
+    ret = !corpus && (matched != SYNTHETIC_FRAMES ||
+        pipeline.results[AC_REPLAY_MATCHED] != SYNTHETIC_FRAMES);
+    if (ret)
+    {
+        fprintf(stderr, "Of %d synthetic frames, %u matched in the pipeline "
+            "and %u at %d%%\n", SYNTHETIC_FRAMES,
+            pipeline.results[AC_REPLAY_MATCHED], matched, DEFAULT_TOLERANCE);
+    }
+
+    replay_free(replay);
+    return ret;
+}
@@ -0,0 +1,19 @@
+#ifndef HOST_DRIVER_RMT_TYPES_H
+#define HOST_DRIVER_RMT_TYPES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Same layout as ESP-IDF's, one RMT symbol holds two durations */
+typedef union {
+    struct {
+        uint16_t duration0 : 15;
+        uint16_t level0 : 1;
+        uint16_t duration1 : 15;
+        uint16_t level1 : 1;
+    };
+    uint32_t val;
+} rmt_symbol_word_t;
+
+#endif
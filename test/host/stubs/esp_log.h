@@ -0,0 +1,17 @@
+#ifndef HOST_ESP_LOG_H
+#define HOST_ESP_LOG_H
+
+#include <inttypes.h>
+#include <stdio.h>
+
+/* Logs are only type checked, the tests feed invalid frames on purpose */
+#define HOST_LOG(tag, fmt, ...) \
+    do { if (0) fprintf(stderr, "%s: " fmt, tag, ##__VA_ARGS__); } while (0)
+
+#define ESP_LOGE(tag, fmt, ...) HOST_LOG(tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) HOST_LOG(tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) HOST_LOG(tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) HOST_LOG(tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGV(tag, fmt, ...) HOST_LOG(tag, fmt, ##__VA_ARGS__)
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef HOST_TEST_H
+#define HOST_TEST_H
+
+#include <stdio.h>
+
+/* Minimal test helpers, a failed check is reported and the test continues */
+extern unsigned int test_failures;
+
+#define TEST_CHECK(cond, fmt, ...) \
+    do { \
+        if (!(cond)) \
+        { \
+            test_failures++; \
+            fprintf(stderr, "%s:%d: %s: " fmt "\n", __FILE__, __LINE__, \
+                #cond, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+#define TEST_RUN(test) \
+    do { \
+        unsigned int failures = test_failures; \
+        test(); \
+        printf("%s %s\n", test_failures == failures ? "PASS" : "FAIL", \
+            #test); \
+    } while (0)
+
+#define TEST_DEFINE_FAILURES unsigned int test_failures = 0
+
+#endif
@@ -0,0 +1,183 @@
+#include "ac.h"
+#include "fakes.h"
+#include "ir_capture.h"
+#include "ir_decoder.h"
+#include "test.h"
+#include <inttypes.h>
+#include <string.h>
+
+TEST_DEFINE_FAILURES;
+
+#define MAX_SYMBOLS 512
+/* Past the duplicate frame window */
+#define FRAME_INTERVAL_US (1000 * 1000)
+
+static int64_t capture_time = 0;
+
+static const ac_mode_t modes[] = {
+    AC_MODE_COOL, AC_MODE_HEAT, AC_MODE_AUTO, AC_MODE_DRY, AC_MODE_FAN,
+};
+static const ac_fan_t fans[] = {
+    AC_FAN_LOW, AC_FAN_MEDIUM, AC_FAN_HIGH, AC_FAN_AUTO,
+};
+
+static int capture_recv(uint64_t value, unsigned int jitter)
+{
+    rmt_symbol_word_t symbols[MAX_SYMBOLS];
+    size_t len = ir_capture_simulate(fake_ir_sent.protocol, value, jitter,
+        100, symbols, MAX_SYMBOLS);
+
+    capture_time += FRAME_INTERVAL_US;
+    return ac_ir_recv(symbols, len, capture_time);
+}
+
+/* Every state the Airwell codec supports survives ac_ir_send(), a jittery
+ * capture of the transmitted frame, and ac_ir_recv() */
+static void test_airwell_round_trip(void)
+{
+    rmt_symbol_word_t symbols[MAX_SYMBOLS];
+    int temperature;
+    size_t m, f, len;
+
+    ir_capture_seed(1);
+    for (temperature = 16; temperature <= 30; temperature++)
+    {
+        for (m = 0; m < sizeof(modes) / sizeof(*modes); m++)
+        {
+            for (f = 0; f < sizeof(fans) / sizeof(*fans); f++)
+            {
+                uint64_t value;
+
+                ac_set_temperature(temperature);
+                ac_set_mode(modes[m]);
+                ac_set_fan(fans[f]);
+                TEST_CHECK(!ac_ir_send(0), "sending %dC", temperature);
+                value = fake_ir_sent.value;
+
+                len = ir_capture_simulate(fake_ir_sent.protocol, value, 15,
+                    100, symbols, MAX_SYMBOLS);
+                TEST_CHECK(ac_ir_replay(symbols, len, 25) ==
+                    AC_REPLAY_MATCHED, "replaying 0x%" PRIx64, value);
+
+                /* Move away from the sent state, the frame brings it back */
+                ac_set_temperature(temperature == 16 ? 30 : 16);
+                ac_set_mode(modes[(m + 1) % (sizeof(modes) / sizeof(*modes))]);
+                ac_set_fan(fans[(f + 1) % (sizeof(fans) / sizeof(*fans))]);
+                TEST_CHECK(!capture_recv(value, 15),
+                    "receiving 0x%" PRIx64, value);
+
+                TEST_CHECK(ac_get_power(), "power after 0x%" PRIx64, value);
+                TEST_CHECK(ac_get_temperature() == temperature,
+                    "%dC decoded as %dC", temperature, ac_get_temperature());
+                TEST_CHECK(ac_get_mode() == modes[m], "mode %d decoded as %d",
+                    modes[m], ac_get_mode());
+                TEST_CHECK(ac_get_fan() == fans[f], "fan %d decoded as %d",
+                    fans[f], ac_get_fan());
+            }
+        }
+    }
+}
+
+/* The same frame within the window of its burst's first capture is dropped,
+ * by capture time and no matter when it's decoded */
+static void test_airwell_duplicate(void)
+{
+    uint64_t value;
+
+    ac_set_temperature(22);
+    ac_ir_send(0);
+    value = fake_ir_sent.value;
+
+    TEST_CHECK(!capture_recv(value, 5), "first frame");
+    capture_time -= FRAME_INTERVAL_US - 200 * 1000;
+    fake_time_advance(FRAME_INTERVAL_US);
+    TEST_CHECK(capture_recv(value, 5) == 1, "repeated burst");
+
+    /* Pressed again, 200ms after the repeat but 400ms after the first */
+    capture_time -= FRAME_INTERVAL_US - 200 * 1000;
+    TEST_CHECK(!capture_recv(value, 5), "second press");
+}
+
+/* Malformed frames are counted and don't change the state */
+static void test_airwell_rejected(void)
+{
+    uint32_t structure = ac_get_rejected_frames(AC_REJECT_STRUCTURE);
+    uint32_t range = ac_get_rejected_frames(AC_REJECT_RANGE);
+    uint64_t value;
+
+    ac_set_temperature(24);
+    ac_ir_send(0);
+    value = fake_ir_sent.value;
+
+    /* Bit 1 is always set */
+    TEST_CHECK(capture_recv(value & ~(1ULL << 1), 5) == -1, "no one bit");
+    /* Temperatures are offset by 15, 0 is out of range */
+    TEST_CHECK(capture_recv(value & ~(0xFULL << 19), 5) == -1,
+        "temperature out of range");
+
+    TEST_CHECK(ac_get_rejected_frames(AC_REJECT_STRUCTURE) == structure + 1,
+        "structure rejections");
+    TEST_CHECK(ac_get_rejected_frames(AC_REJECT_RANGE) == range + 1,
+        "range rejections");
+    TEST_CHECK(ac_get_temperature() == 24, "temperature changed to %dC",
+        ac_get_temperature());
+}
+
+/* Captures that start with noise, rather than with the header, still decode,
+ * with either coding */
+static void test_leading_noise(void)
+{
+    rmt_symbol_word_t symbols[MAX_SYMBOLS];
+    rmt_symbol_word_t noise = { .duration0 = 150, .level0 = 0,
+        .duration1 = 300, .level1 = 1 };
+    uint64_t value, nec = 0x1CE3A05F, decoded;
+    ir_protocol_t *protocol;
+    size_t len;
+    int i;
+
+    ac_set_temperature(22);
+    ac_ir_send(0);
+    value = fake_ir_sent.value;
+    symbols[0] = noise;
+    len = ir_capture_simulate(fake_ir_sent.protocol, value, 5, 100,
+        &symbols[1], MAX_SYMBOLS - 1);
+    ac_set_temperature(16);
+    capture_time += FRAME_INTERVAL_US;
+    TEST_CHECK(!ac_ir_recv(symbols, len + 1, capture_time),
+        "receiving 0x%" PRIx64 " after noise", value);
+    TEST_CHECK(ac_get_temperature() == 22, "temperature is %dC",
+        ac_get_temperature());
+
+    /* NEC frames are parsed from their header only */
+    symbols[1] = (rmt_symbol_word_t){ .duration0 = 9000, .level0 = 0,
+        .duration1 = 4500, .level1 = 1 };
+    for (i = 0; i < 32; i++)
+    {
+        symbols[2 + i] = (rmt_symbol_word_t){ .duration0 = 560, .level0 = 0,
+            .duration1 = nec & (1ULL << i) ? 1690 : 560, .level1 = 1 };
+    }
+    protocol = ir_decoder_decode(symbols, 34, &decoded);
+    TEST_CHECK(protocol && !strcmp(protocol->name, "NEC") && decoded == nec,
+        "decoding NEC after noise, got %s 0x%" PRIx64,
+        protocol ? protocol->name : "nothing", protocol ? decoded : 0);
+}
+
+int main(void)
+{
+    if (ir_decoder_initialize() || ac_initialize("airwell"))
+    {
+        fprintf(stderr, "Failed initializing the AC\n");
+        return 1;
+    }
+
+    /* The AC is on, so frames don't carry a power toggle */
+    ac_set_detected_power(1);
+    ac_set_power(1);
+
+    TEST_RUN(test_airwell_round_trip);
+    TEST_RUN(test_airwell_duplicate);
+    TEST_RUN(test_airwell_rejected);
+    TEST_RUN(test_leading_noise);
+
+    return test_failures ? 1 : 0;
+}
@@ -0,0 +1,140 @@
+#include "ir_capture.h"
+#include "protocol_parsers.h"
+#include "test.h"
+#include <inttypes.h>
+
+TEST_DEFINE_FAILURES;
+
+#define ROUND_TRIPS 20000
+#define MAX_SYMBOLS 512
+
+/* Same timing as the Airwell remote */
+static manchester_protocol_t protocol_template = {
+    .header_mark = 3 * 950,
+    .header_space = 3 * 950,
+    .half_period = 950,
+    .tail_mark = 4 * 950,
+    .bits = 34,
+    .repeat = 3,
+};
+
+static manchester_protocol_t protocol_get(void)
+{
+    manchester_protocol_t protocol = protocol_template;
+
+    manchester_protocol_init(&protocol);
+    return protocol;
+}
+
+/* generate_manchester() -> jitter -> parse_manchester() yields the value, as
+ * long as the jitter is within the decoder's tolerance */
+static void test_round_trip_with_jitter(void)
+{
+    static const unsigned int jitters[] = { 0, 5, 10, 15, 20 };
+    manchester_protocol_t protocol = protocol_get();
+    rmt_symbol_word_t symbols[MAX_SYMBOLS];
+    size_t i, j, len;
+
+    ir_capture_seed(1);
+    for (j = 0; j < sizeof(jitters) / sizeof(*jitters); j++)
+    {
+        unsigned int failures = 0;
+
+        for (i = 0; i < ROUND_TRIPS; i++)
+        {
+            uint64_t value = ir_capture_random_value(&protocol);
+
+            len = ir_capture_simulate(&protocol, value, jitters[j], 100,
+                symbols, MAX_SYMBOLS);
+            if (parse_manchester(&protocol, symbols, len) != value)
+                failures++;
+        }
+
+        TEST_CHECK(!failures, "%u of %d frames failed with %u%% jitter",
+            failures, ROUND_TRIPS, jitters[j]);
+    }
+}
+
+/* The exact symbols generate_manchester() emits decode as well */
+static void test_round_trip_generated(void)
+{
+    manchester_protocol_t protocol = protocol_get();
+    rmt_symbol_word_t symbols[MAX_SYMBOLS];
+    size_t i;
+
+    ir_capture_seed(2);
+    for (i = 0; i < ROUND_TRIPS; i++)
+    {
+        uint64_t value = ir_capture_random_value(&protocol);
+        size_t len = ir_capture_simulate(&protocol, value, 0, 100, symbols,
+            MAX_SYMBOLS);
+
+        TEST_CHECK(!generate_manchester(&protocol, value, symbols,
+            sizeof(symbols)), "generating 0x%" PRIx64, value);
+        TEST_CHECK(!manchester_compare(&protocol, value, symbols,
+            manchester_frame_symbols(&protocol)), "comparing 0x%" PRIx64,
+            value);
+        TEST_CHECK(len, "simulating 0x%" PRIx64, value);
+    }
+}
+
+/* Timing well outside of the tolerance windows never decodes */
+static void test_out_of_tolerance(void)
+{
+    static const unsigned int scales[] = { 50, 150 };
+    manchester_protocol_t protocol = protocol_get();
+    rmt_symbol_word_t symbols[MAX_SYMBOLS];
+    size_t i, j, len;
+
+    ir_capture_seed(3);
+    for (j = 0; j < sizeof(scales) / sizeof(*scales); j++)
+    {
+        unsigned int decoded = 0;
+
+        for (i = 0; i < ROUND_TRIPS / 10; i++)
+        {
+            uint64_t value = ir_capture_random_value(&protocol);
+
+            len = ir_capture_simulate(&protocol, value, 0, scales[j],
+                symbols, MAX_SYMBOLS);
+            if (parse_manchester(&protocol, symbols, len))
+                decoded++;
+        }
+
+        TEST_CHECK(!decoded, "%u frames decoded at %u%% timing", decoded,
+            scales[j]);
+    }
+}
+
+/* Truncated captures are rejected or decode to the sent value, never to a
+ * different one */
+static void test_truncated(void)
+{
+    manchester_protocol_t protocol = protocol_get();
+    rmt_symbol_word_t symbols[MAX_SYMBOLS];
+    size_t i, cut, len;
+
+    ir_capture_seed(4);
+    for (i = 0; i < ROUND_TRIPS / 10; i++)
+    {
+        uint64_t value = ir_capture_random_value(&protocol), parsed;
+
+        len = ir_capture_simulate(&protocol, value, 10, 100, symbols,
+            MAX_SYMBOLS);
+        cut = 1 + ir_capture_random() % (len - 1);
+        parsed = parse_manchester(&protocol, symbols, cut);
+        TEST_CHECK(!parsed || parsed == value,
+            "0x%" PRIx64 " cut at %zu of %zu decoded as 0x%" PRIx64, value,
+            cut, len, parsed);
+    }
+}
+
+int main(void)
+{
+    TEST_RUN(test_round_trip_generated);
+    TEST_RUN(test_round_trip_with_jitter);
+    TEST_RUN(test_out_of_tolerance);
+    TEST_RUN(test_truncated);
+
+    return test_failures ? 1 : 0;
+}